@@ -0,0 +1,166 @@
+#include "cc.h"
+
+#include <math.h>
+#include <string.h>
+
+/* CUBIC constants of RFC 8312 */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+static inline uint32_t cc_clamp(const cc_t *cc, uint32_t cwnd){
+	if(cwnd < CC_LOSS_WINDOW) return CC_LOSS_WINDOW;
+	return cwnd < cc->max_cwnd ? cwnd : cc->max_cwnd;
+}
+
+/* Slow start: one more packet per packet acknowledged, up to ssthresh
+ * @return: the packets acknowledged beyond ssthresh, left to congestion avoidance */
+static uint32_t slow_start(cc_t *cc, uint32_t acked){
+	uint32_t room = cc->ssthresh - cc->cwnd;
+	uint32_t used = acked < room ? acked : room;
+	cc->cwnd = cc_clamp(cc, cc->cwnd + used);
+	return acked - used;
+}
+
+/* Grow by one packet every cnt packets acknowledged */
+static void grow(cc_t *cc, uint32_t acked, uint32_t cnt){
+	cc->acked += acked;
+	if(cc->acked >= cnt){
+		cc->cwnd = cc_clamp(cc, cc->cwnd + cc->acked / cnt);
+		cc->acked %= cnt;
+	}
+}
+
+/* No congestion control: the receiver window is the only limit */
+
+static void none_on_ack(cc_t *cc, uint32_t acked, uint32_t srtt, uint64_t now){
+	(void) acked; (void) srtt; (void) now;
+	cc->cwnd = cc->max_cwnd;
+}
+
+static void none_on_event(cc_t *cc, uint64_t now){
+	(void) now;
+	cc->cwnd = cc->max_cwnd;
+}
+
+const cc_ops_t cc_none = {"none", none_on_ack, none_on_event, none_on_event};
+
+/* Reno (RFC 5681): additive increase of one packet per RTT, the window is halved on a loss */
+
+static void reno_on_ack(cc_t *cc, uint32_t acked, uint32_t srtt, uint64_t now){
+	(void) srtt; (void) now;
+	if(cc->cwnd < cc->ssthresh){
+		acked = slow_start(cc, acked);
+	}
+	if(acked){
+		grow(cc, acked, cc->cwnd);
+	}
+}
+
+static void reno_on_loss(cc_t *cc, uint64_t now){
+	(void) now;
+	cc->ssthresh = cc->cwnd / 2 > CC_MIN_WINDOW ? cc->cwnd / 2 : CC_MIN_WINDOW;
+	cc->cwnd = cc_clamp(cc, cc->ssthresh);
+	cc->acked = 0;
+}
+
+static void reno_on_timeout(cc_t *cc, uint64_t now){
+	reno_on_loss(cc, now);
+	cc->cwnd = CC_LOSS_WINDOW;
+}
+
+const cc_ops_t cc_reno = {"reno", reno_on_ack, reno_on_loss, reno_on_timeout};
+
+/* CUBIC (RFC 8312): after a loss the window follows a cubic function of the time elapsed,
+ * which flattens around the window w_max where the loss happened, so it does not depend on the RTT */
+
+static void cubic_on_ack(cc_t *cc, uint32_t acked, uint32_t srtt, uint64_t now){
+	if(cc->cwnd < cc->ssthresh){
+		acked = slow_start(cc, acked);
+	}
+	if(!acked){
+		return;
+	}
+	if(!cc->epoch){
+		cc->epoch = now;
+		if(cc->cwnd < cc->w_max){
+			cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+		} else {
+			cc->k = 0;
+			cc->w_max = cc->cwnd;
+		}
+	}
+	/* Window one RTT from now, but never slower than Reno would be (TCP-friendly region) */
+	double t = (now - cc->epoch + srtt) / 1e6;
+	double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+	if(srtt){
+		double reno = cc->w_max * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (now - cc->epoch) / srtt;
+		if(reno > target) target = reno;
+	}
+	uint32_t cnt = 100 * cc->cwnd;
+	if(target > cc->cwnd){
+		double per = cc->cwnd / (target - cc->cwnd);
+		cnt = per < 1 ? 1 : (uint32_t) per;
+	}
+	grow(cc, acked, cnt);
+}
+
+static void cubic_reduce(cc_t *cc){
+	/* Fast convergence: give up some room if the last loss happened at a smaller window */
+	cc->w_max = cc->cwnd < cc->w_max ? cc->cwnd * (1 + CUBIC_BETA) / 2 : cc->cwnd;
+	cc->ssthresh = cc->cwnd * CUBIC_BETA > CC_MIN_WINDOW ? cc->cwnd * CUBIC_BETA : CC_MIN_WINDOW;
+	cc->epoch = 0;
+	cc->acked = 0;
+}
+
+static void cubic_on_loss(cc_t *cc, uint64_t now){
+	(void) now;
+	cubic_reduce(cc);
+	cc->cwnd = cc_clamp(cc, cc->ssthresh);
+}
+
+static void cubic_on_timeout(cc_t *cc, uint64_t now){
+	(void) now;
+	cubic_reduce(cc);
+	cc->cwnd = CC_LOSS_WINDOW;
+}
+
+const cc_ops_t cc_cubic = {"cubic", cubic_on_ack, cubic_on_loss, cubic_on_timeout};
+
+const cc_ops_t* cc_find(const char *name){
+	const cc_ops_t *all[] = {&cc_none, &cc_reno, &cc_cubic};
+	for(size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++){
+		if(!strcmp(all[i]->name, name)) return all[i];
+	}
+	return NULL;
+}
+
+void cc_init(cc_t *cc, const cc_ops_t *ops, uint32_t max_cwnd){
+	memset(cc, 0, sizeof(cc_t));
+	cc->ops = ops;
+	cc->ssthresh = UINT32_MAX;
+	cc->max_cwnd = max_cwnd;
+	cc->cwnd = ops == &cc_none ? max_cwnd : cc_clamp(cc, CC_INITIAL_WINDOW);
+}
+
+void cc_on_timeout(cc_t *cc, uint64_t now){
+	if(!cc->undo){
+		cc->prior.cwnd = cc->cwnd;
+		cc->prior.ssthresh = cc->ssthresh;
+		cc->prior.w_max = cc->w_max;
+		cc->undo = true;
+	}
+	cc->ops->on_timeout(cc, now);
+}
+
+void cc_undo(cc_t *cc){
+	if(!cc->undo){
+		return;
+	}
+	if(cc->prior.cwnd > cc->cwnd){
+		cc->cwnd = cc_clamp(cc, cc->prior.cwnd);
+	}
+	cc->ssthresh = cc->prior.ssthresh;
+	cc->w_max = cc->prior.w_max;
+	cc->epoch = 0;
+	cc->undo = false;
+}
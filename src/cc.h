@@ -0,0 +1,86 @@
+#ifndef __CC_H_
+#define __CC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Congestion window of a new connection and after a timeout, in packets */
+#define CC_INITIAL_WINDOW 10
+#define CC_LOSS_WINDOW 1
+/* Smallest window after a multiplicative decrease */
+#define CC_MIN_WINDOW 2
+
+typedef struct cc cc_t;
+
+/* A congestion control algorithm. Windows are counted in packets, times in microseconds.
+ * @on_ack: acked packets newly reached the receiver, srtt is the current smoothed RTT
+ * @on_loss: a loss was detected from duplicate ACKs, called once per window of data
+ * @on_timeout: the oldest packet in flight timed out
+ */
+typedef struct cc_ops {
+	const char *name;
+	void (*on_ack)(cc_t *cc, uint32_t acked, uint32_t srtt, uint64_t now);
+	void (*on_loss)(cc_t *cc, uint64_t now);
+	void (*on_timeout)(cc_t *cc, uint64_t now);
+} cc_ops_t;
+
+/* State shared by all the algorithms, the CUBIC fields are unused by the others
+ * @cwnd: packets that may be in the network, i.e. sent and neither acknowledged nor reported lost
+ * @max_cwnd: upper bound of cwnd, set by the size of the sending window
+ * @acked: packets acknowledged since cwnd was last increased in congestion avoidance
+ * @w_max: CUBIC, window before the last reduction
+ * @epoch: CUBIC, start of the current growth period, 0 if none began
+ * @k: CUBIC, time (in s) the cubic function takes to grow back to w_max
+ * @undo: a timeout reduced the window, prior holds the state to restore if it turns out spurious
+ */
+struct cc {
+	const cc_ops_t *ops;
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	uint32_t max_cwnd;
+	uint32_t acked;
+	uint32_t w_max;
+	uint64_t epoch;
+	double k;
+	bool undo;
+	struct {
+		uint32_t cwnd;
+		uint32_t ssthresh;
+		uint32_t w_max;
+	} prior;
+};
+
+extern const cc_ops_t cc_none;
+extern const cc_ops_t cc_reno;
+extern const cc_ops_t cc_cubic;
+
+/* Look an algorithm up by name
+ * @return: NULL if there is no such algorithm
+ */
+const cc_ops_t* cc_find(const char *name);
+
+/* Start a connection with the given algorithm, cwnd never exceeds max_cwnd */
+void cc_init(cc_t *cc, const cc_ops_t *ops, uint32_t max_cwnd);
+
+static inline void cc_on_ack(cc_t *cc, uint32_t acked, uint32_t srtt, uint64_t now){
+	cc->ops->on_ack(cc, acked, srtt, now);
+}
+
+static inline void cc_on_loss(cc_t *cc, uint64_t now){
+	cc->ops->on_loss(cc, now);
+}
+
+/* The oldest packet timed out, the window before the first of consecutive timeouts is kept
+ * until cc_undo() or cc_commit() */
+void cc_on_timeout(cc_t *cc, uint64_t now);
+
+/* The packet that timed out was acknowledged by an ACK for its original transmission
+ * (Eifel detection, RFC 3522): restore the window it had before */
+void cc_undo(cc_t *cc);
+
+/* The timeout was genuine, forget the prior window */
+static inline void cc_commit(cc_t *cc){
+	cc->undo = false;
+}
+
+#endif // __CC_H_
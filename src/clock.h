@@ -0,0 +1,27 @@
+#ifndef __CLOCK_H_
+#define __CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* Monotonic clock in microseconds */
+static inline uint64_t clock_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Value carried by the 32-bit timestamp field of the packets: the low
+ * bits of clock_us(). It wraps after ~71 minutes, so only differences
+ * computed with clock_stamp_elapsed() are meaningful.
+ */
+static inline uint32_t clock_stamp(void){
+	return (uint32_t) clock_us();
+}
+
+/* Microseconds elapsed since a timestamp produced by clock_stamp() */
+static inline uint32_t clock_stamp_elapsed(uint32_t stamp){
+	return clock_stamp() - stamp;
+}
+
+#endif // __CLOCK_H_
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "packet.h"
+#include "crc.h"
+
+/* Microbenchmark of the packet codec (make bench): each case runs for at least the given time per
+ * round, and the median of BENCH_ROUNDS rounds is reported, in JSON on the output and as a table
+ * on stderr so that builds can be compared.
+ */
+
+#define BENCH_ROUNDS 5
+#define BENCH_MAX_CASES 64
+#define BUF_SIZE (EXT_HEADER_SIZE + EXT_MAX_PAYLOAD_SIZE + 4)
+
+/* One case: run() handles one packet per call, its result goes to the sink so that it is not optimized out */
+typedef struct bench_case {
+	char name[48];
+	size_t bytes;           // Size of the encoded packet, or of the buffer for the CRC alone
+	uint64_t (*run)(struct bench_case *c);
+	pkt_t pkt;              // Packet to encode
+	char *wire;             // Packet to decode, bytes long
+} bench_case_t;
+
+static char payload[EXT_MAX_PAYLOAD_SIZE];
+static char out[BUF_SIZE];
+volatile uint64_t sink;
+bench_case_t cases[BENCH_MAX_CASES];
+int n_cases = 0;
+
+/* Register a case, named after the printf-like format */
+__attribute__((format(printf, 2, 3)))
+static bench_case_t* add_case(uint64_t (*run)(bench_case_t*), const char *fmt, ...){
+	bench_case_t *c = &cases[n_cases++];
+	memset(c, 0, sizeof(bench_case_t));
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(c->name, sizeof(c->name), fmt, args);
+	va_end(args);
+	c->run = run;
+	return c;
+}
+
+static uint64_t run_encode(bench_case_t *c){
+	size_t len = BUF_SIZE;
+	return pkt_encode(&c->pkt, out, &len) + len;
+}
+
+/* What the sender does for every transmission: the payload and its CRC are already in place */
+static uint64_t run_encode_header(bench_case_t *c){
+	size_t len = BUF_SIZE;
+	return pkt_encode_header(&c->pkt, out, &len) + len;
+}
+
+static uint64_t run_decode_view(bench_case_t *c){
+	pkt_view_t view;
+	return pkt_decode_view(c->wire, c->bytes, &view) + view.length;
+}
+
+static uint64_t run_decode(bench_case_t *c){
+	pkt_t *pkt = pkt_new();
+	uint64_t ret = pkt_decode(c->wire, c->bytes, pkt) + pkt_get_length(pkt);
+	pkt_del(pkt);
+	return ret;
+}
+
+static uint64_t run_crc(bench_case_t *c){
+	return crc_compute(payload, c->bytes);
+}
+
+/* Fill the packet of a case and encode it once in c->wire
+ * @corrupt: offset of a byte to flip in the encoded packet, -1 to leave it intact
+ */
+static int setup(bench_case_t *c, ptypes_t type, bool ext, uint8_t tr, uint16_t length, int corrupt){
+	pkt_t *pkt = &c->pkt;
+	pkt_set_ext(pkt, ext);
+	pkt_set_type(pkt, type);
+	pkt_set_window(pkt, ext ? 4095 : MAX_WINDOW_SIZE);
+	pkt_set_seqnum(pkt, ext ? 123456789 : 200);
+	pkt_set_timestamp(pkt, 0xdeadbeef);
+	pkt_set_length(pkt, length);
+	pkt->payload = length ? payload : NULL;
+	c->wire = malloc(BUF_SIZE);
+	size_t len = BUF_SIZE;
+	if(c->wire == NULL || pkt_encode(pkt, c->wire, &len) != PKT_OK){
+		fprintf(stderr, "Could not encode the packet of %s\n", c->name);
+		return -1;
+	}
+	/* A truncated packet loses its payload and its Length on the way, TR is set after the CRC1 */
+	if(tr){
+		pkt_set_length(pkt, 0);
+		len = BUF_SIZE;
+		pkt_encode_header(pkt, c->wire, &len);
+		c->wire[0] |= 0x20;
+	}
+	if(corrupt >= 0){
+		c->wire[corrupt] ^= 0x20;
+	}
+	c->bytes = len;
+	return 0;
+}
+
+static double elapsed_ns(struct timespec *start){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+/* @return: the median time of one call to c->run(), in nanoseconds */
+static double measure(bench_case_t *c, double round_ns){
+	/* Calibration: the iterations of a round double until it lasts long enough */
+	uint64_t iterations = 1;
+	for(;;){
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(uint64_t i = 0; i < iterations; i++) sink += c->run(c);
+		if(elapsed_ns(&start) >= round_ns) break;
+		iterations *= 2;
+	}
+	double rounds[BENCH_ROUNDS];
+	for(int r = 0; r < BENCH_ROUNDS; r++){
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(uint64_t i = 0; i < iterations; i++) sink += c->run(c);
+		double ns = elapsed_ns(&start) / iterations;
+		/* Insertion sort, the rounds are few */
+		int k = r;
+		while(k > 0 && rounds[k-1] > ns){
+			rounds[k] = rounds[k-1];
+			k--;
+		}
+		rounds[k] = ns;
+	}
+	return rounds[BENCH_ROUNDS / 2];
+}
+
+int print_usage(char *prog_name){
+	fprintf(stderr, "Usage:\n\t%s [-o output_file] [-t milliseconds] [-f filter]\n", prog_name);
+	fprintf(stderr, "\t-o: write the JSON results to output_file instead of stdout\n");
+	fprintf(stderr, "\t-t: minimal duration of a round of a case (default 20 ms)\n");
+	fprintf(stderr, "\t-f: only run the cases whose name contains filter\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv){
+	const char *output = NULL;
+	const char *filter = NULL;
+	double round_ns = 20e6;
+	int opt;
+	while((opt = getopt(argc, argv, "o:t:f:h")) != -1){
+		switch(opt){
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			round_ns = atof(optarg) * 1e6;
+			if(round_ns <= 0) return print_usage(argv[0]);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			return print_usage(argv[0]);
+		}
+	}
+
+	crc_init();
+	for(size_t i = 0; i < sizeof(payload); i++){
+		payload[i] = (char) (i * 2654435761u >> 13);
+	}
+
+	/* Sizes: the legacy payloads, a payload that fits an Ethernet frame and jumbo payloads */
+	static const uint16_t legacy_sizes[] = {0, 64, 512};
+	static const uint16_t ext_sizes[] = {512, 1400, 8192, 65000};
+	int failed = 0;
+	for(size_t i = 0; i < sizeof(legacy_sizes) / sizeof(legacy_sizes[0]); i++){
+		uint16_t size = legacy_sizes[i];
+		failed |= setup(add_case(run_encode, "data_encode_legacy_%u", size), PTYPE_DATA, false, 0, size, -1);
+		failed |= setup(add_case(run_decode_view, "data_decode_legacy_%u", size), PTYPE_DATA, false, 0, size, -1);
+	}
+	for(size_t i = 0; i < sizeof(ext_sizes) / sizeof(ext_sizes[0]); i++){
+		uint16_t size = ext_sizes[i];
+		failed |= setup(add_case(run_encode, "data_encode_ext_%u", size), PTYPE_DATA, true, 0, size, -1);
+		failed |= setup(add_case(run_encode_header, "data_encode_header_ext_%u", size), PTYPE_DATA, true, 0, size, -1);
+		failed |= setup(add_case(run_decode_view, "data_decode_ext_%u", size), PTYPE_DATA, true, 0, size, -1);
+	}
+	failed |= setup(add_case(run_decode, "data_decode_alloc_legacy_%u", MAX_PAYLOAD_SIZE), PTYPE_DATA, false, 0, MAX_PAYLOAD_SIZE, -1);
+
+	/* Acknowledgements: legacy, extended with a selective acknowledgement of 64 bytes */
+	failed |= setup(add_case(run_encode, "ack_encode_legacy"), PTYPE_ACK, false, 0, 0, -1);
+	failed |= setup(add_case(run_decode_view, "ack_decode_legacy"), PTYPE_ACK, false, 0, 0, -1);
+	failed |= setup(add_case(run_encode, "ack_encode_ext_sack_64"), PTYPE_ACK, true, 0, 64, -1);
+	failed |= setup(add_case(run_decode_view, "ack_decode_ext_sack_64"), PTYPE_ACK, true, 0, 64, -1);
+	failed |= setup(add_case(run_encode, "nack_encode_legacy"), PTYPE_NACK, false, 0, 0, -1);
+	failed |= setup(add_case(run_decode_view, "nack_decode_legacy"), PTYPE_NACK, false, 0, 0, -1);
+
+	/* Truncated packets only carry their header */
+	failed |= setup(add_case(run_decode_view, "truncated_decode_legacy_512"), PTYPE_DATA, false, 1, MAX_PAYLOAD_SIZE, -1);
+	failed |= setup(add_case(run_decode_view, "truncated_decode_ext_1400"), PTYPE_DATA, true, 1, 1400, -1);
+
+	/* Corruption: a flipped bit in the Timestamp fails the CRC1, in the payload the CRC2 */
+	failed |= setup(add_case(run_decode_view, "corrupt_header_decode_legacy_512"), PTYPE_DATA, false, 0, MAX_PAYLOAD_SIZE, 5);
+	failed |= setup(add_case(run_decode_view, "corrupt_payload_decode_legacy_512"), PTYPE_DATA, false, 0, MAX_PAYLOAD_SIZE, DATA_HEADER_SIZE + 100);
+	failed |= setup(add_case(run_decode_view, "corrupt_header_decode_ext_8192"), PTYPE_DATA, true, 0, 8192, 13);
+	failed |= setup(add_case(run_decode_view, "corrupt_payload_decode_ext_8192"), PTYPE_DATA, true, 0, 8192, EXT_HEADER_SIZE + 100);
+
+	/* The CRC kernel alone */
+	static const size_t crc_sizes[] = {16, 64, 512, 1400, 8192, 65000};
+	for(size_t i = 0; i < sizeof(crc_sizes) / sizeof(crc_sizes[0]); i++){
+		add_case(run_crc, "crc_%lu", (unsigned long) crc_sizes[i])->bytes = crc_sizes[i];
+	}
+	if(failed){
+		return EXIT_FAILURE;
+	}
+
+	/* The expected status of each decode is checked once, a case that decodes wrongly measures nothing */
+	for(int i = 0; i < n_cases; i++){
+		if(cases[i].run != run_decode_view) continue;
+		pkt_view_t view;
+		pkt_status_code status = pkt_decode_view(cases[i].wire, cases[i].bytes, &view);
+		pkt_status_code expected = strncmp(cases[i].name, "corrupt", 7) ? PKT_OK : E_CRC;
+		if(status != expected){
+			fprintf(stderr, "%s decodes with status %d instead of %d\n", cases[i].name, status, expected);
+			return EXIT_FAILURE;
+		}
+	}
+
+	FILE *fd = output == NULL ? stdout : fopen(output, "w");
+	if(fd == NULL){
+		fprintf(stderr, "Could not open %s\n", output);
+		return EXIT_FAILURE;
+	}
+	fprintf(fd, "{\n  \"crc_kernel\": \"%s\",\n  \"rounds\": %d,\n  \"round_ms\": %.1f,\n  \"results\": [",
+	        crc_kernel_name(), BENCH_ROUNDS, round_ns / 1e6);
+	fprintf(stderr, "%-36s %8s %12s %10s\n", "case", "bytes", "ns/packet", "Mpps");
+	bool first = true;
+	for(int i = 0; i < n_cases; i++){
+		bench_case_t *c = &cases[i];
+		if(filter != NULL && strstr(c->name, filter) == NULL) continue;
+		double ns = measure(c, round_ns);
+		fprintf(stderr, "%-36s %8lu %12.2f %10.2f\n", c->name, (unsigned long) c->bytes, ns, 1e3 / ns);
+		fprintf(fd, "%s\n    {\"name\": \"%s\", \"bytes\": %lu, \"ns_per_packet\": %.3f, \"mpps\": %.3f}",
+		        first ? "" : ",", c->name, (unsigned long) c->bytes, ns, 1e3 / ns);
+		first = false;
+	}
+	fprintf(fd, "\n  ]\n}\n");
+	if(fd != stdout){
+		fclose(fd);
+	}
+	for(int i = 0; i < n_cases; i++){
+		free(cases[i].wire);
+	}
+	return EXIT_SUCCESS;
+}
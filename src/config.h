@@ -4,6 +4,48 @@
 #define N 32
 #define WINDOW_MAX_SIZE 31
 #define MAX_SEQ_SIZE 256
-#define MAX_PKT_SIZE 12+MAX_PAYLOAD_SIZE+4
+#define MAX_PKT_SIZE EXT_HEADER_SIZE+EXT_MAX_PAYLOAD_SIZE+4
+// Window buffers in the extended format, a power of two like N
+#define EXT_WINDOW_SIZE 4096
+// Duplicate ACKs that trigger a fast retransmit of the oldest packet
+#define DUP_ACK_THRESHOLD 3
+// HELLO frames sent before falling back to the original format
+#define HELLO_ATTEMPTS 3
+// Bytes of payload the receiver buffers at most in the extended format
+#define EXT_BUFFER_SIZE (32 << 20)
+// Socket buffers asked for in the extended format
+#define SOCKET_BUFFER_SIZE (4 << 20)
+// IPv6 and UDP headers, extended header and CRC2 around a payload
+#define EXT_FRAME_OVERHEAD (40 + 8 + EXT_HEADER_SIZE + 4)
+// The receiver acknowledges every DELAYED_ACK_COUNT in-order packets, or DELAYED_ACK_TIMEOUT us after the first
+#define DELAYED_ACK_COUNT 4
+#define DELAYED_ACK_TIMEOUT 2000
+// Buckets of the table of senders served by the receiver in server mode
+#define FLOW_BUCKETS 256
+// A sender silent for FLOW_TIMEOUT us is given up, a finished one is answered for FLOW_LINGER us more
+#define FLOW_TIMEOUT 30000000
+#define FLOW_LINGER 10000000
+// Full packets the pacing bucket lets leave back to back
+#define PACING_BURST 8
+// Frames the input thread of the sender encodes ahead of the network thread
+#define SENDER_RING_SIZE 256
+#define CACHE_LINE_SIZE 64
+// A compressed payload must be at least 1/COMPRESS_MIN_GAIN smaller than the original one
+#define COMPRESS_MIN_GAIN 8
+// Payloads sent as they are after one that did not compress, doubled for each further one up to COMPRESS_MAX_SKIP
+#define COMPRESS_MAX_SKIP 256
+// FEC groups have FEC_MIN_GROUP to FEC_MAX_GROUP packets, so that a group loses (group + 1) * loss < 1/4 packets on average.
+// Below the loss rate at which FEC_MAX_GROUP is reached, no repair is sent
+#define FEC_MIN_GROUP 2
+#define FEC_MAX_GROUP 64
+// The loss rate is averaged over about 1 << FEC_LOSS_SHIFT packets
+#define FEC_LOSS_SHIFT 7
+// FEC groups whose parity the receiver keeps at once
+#define FEC_GROUPS 256
+#define BATCH_SIZE 32
+// io_uring (-u): slots the receiver hands to the kernel to receive in, a power of two of at least BATCH_SIZE
+#define URING_BUFFERS 128
+// Largest pool the sender registers with io_uring, its pages are pinned
+#define URING_REGISTER_MAX (64 << 20)
 
 #endif // __CONFIG_H_
@@ -0,0 +1,241 @@
+#include "crc.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC_HAVE_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC_HAVE_SLICE8
+#endif
+
+typedef uint32_t (*crc_kernel_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc_resolve(uint32_t crc, const uint8_t *buf, size_t len);
+
+static crc_kernel_t crc_kernel = crc_resolve;
+static const char *crc_name = "none";
+
+static uint32_t crc_zlib(uint32_t crc, const uint8_t *buf, size_t len){
+	return crc32(crc, buf, len);
+}
+
+#ifdef CRC_HAVE_SLICE8
+static uint32_t crc_table[8][256];
+
+static void crc_init_tables(void){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++){
+			c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for(uint32_t i = 0; i < 256; i++){
+		for(int t = 1; t < 8; t++){
+			crc_table[t][i] = (crc_table[t-1][i] >> 8) ^ crc_table[0][crc_table[t-1][i] & 0xff];
+		}
+	}
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *buf, size_t len){
+	crc = ~crc;
+	// Byte by byte until the buffer is aligned on 8 bytes
+	while(len && ((uintptr_t) buf & 7)){
+		crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while(len >= 8){
+		uint32_t one, two;
+		memcpy(&one, buf, 4);
+		memcpy(&two, buf+4, 4);
+		one ^= crc;
+		crc = crc_table[7][one & 0xff] ^ crc_table[6][(one >> 8) & 0xff]
+		    ^ crc_table[5][(one >> 16) & 0xff] ^ crc_table[4][one >> 24]
+		    ^ crc_table[3][two & 0xff] ^ crc_table[2][(two >> 8) & 0xff]
+		    ^ crc_table[1][(two >> 16) & 0xff] ^ crc_table[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while(len--){
+		crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+#endif
+
+#if defined(CRC_HAVE_PCLMUL) && defined(CRC_HAVE_SLICE8)
+/* Folding constants for the reflected polynomial, x^k mod P(x) */
+static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+static const uint64_t crc_poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+
+/* Folds 64 bytes at a time in four 128 bits lanes, then reduces them
+ * to 32 bits with a Barrett reduction.
+ * @pre: len >= 64 and len is a multiple of 16
+ * @crc: the pre-inverted running CRC
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold(const uint8_t *buf, size_t len, uint32_t crc){
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i*) crc_k1k2);
+	buf += 64;
+	len -= 64;
+
+	// Parallel fold of 64 bytes blocks
+	while(len >= 64){
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	// Fold the four lanes into one
+	x0 = _mm_load_si128((const __m128i*) crc_k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Single fold of the remaining 16 bytes blocks
+	while(len >= 16){
+		x2 = _mm_loadu_si128((const __m128i*) buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i*) crc_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i*) crc_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t *buf, size_t len){
+	// Short buffers (headers) are faster with the tables
+	if(len >= 64){
+		size_t chunk = len & ~(size_t) 15;
+		crc = ~crc_fold(buf, chunk, ~crc);
+		buf += chunk;
+		len -= chunk;
+	}
+	return crc_slice8(crc, buf, len);
+}
+#endif
+
+/* Compare a kernel with zlib on buffers of every length and alignment
+ * up to a few packets long.
+ * @return: 0 if all the CRCs are the same, -1 otherwise
+ */
+static int crc_self_test(crc_kernel_t kernel){
+	static const uint8_t check[] = "123456789";
+	if(kernel(0, check, 9) != 0xcbf43926) return -1;
+
+	uint8_t buf[1100];
+	uint32_t seed = 0x12345678;
+	for(size_t i = 0; i < sizeof(buf); i++){
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+	for(size_t off = 0; off < 16; off++){
+		for(size_t len = 0; len + off <= sizeof(buf); len += off + 1){
+			uint32_t expected = crc32(0, buf + off, len);
+			if(kernel(0, buf + off, len) != expected) return -1;
+			// Chaining must give the same result as one call
+			size_t half = len / 2;
+			if(kernel(kernel(0, buf + off, half), buf + off + half, len - half) != expected) return -1;
+		}
+	}
+	return 0;
+}
+
+void crc_init(void){
+	if(crc_kernel != crc_resolve) return;
+
+	crc_kernel = crc_zlib;
+	crc_name = "zlib";
+#ifdef CRC_HAVE_SLICE8
+	crc_init_tables();
+	if(!crc_self_test(crc_slice8)){
+		crc_kernel = crc_slice8;
+		crc_name = "slice8";
+	} else {
+		ERROR("CRC32 slicing-by-8 kernel failed its self-test");
+	}
+#ifdef CRC_HAVE_PCLMUL
+	__builtin_cpu_init();
+	if(crc_kernel == crc_slice8 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")){
+		if(!crc_self_test(crc_pclmul)){
+			crc_kernel = crc_pclmul;
+			crc_name = "pclmul";
+		} else {
+			ERROR("CRC32 PCLMULQDQ kernel failed its self-test");
+		}
+	}
+#endif
+#endif
+	DEBUG("CRC32 kernel: %s", crc_name);
+}
+
+const char* crc_kernel_name(void){
+	crc_init();
+	return crc_name;
+}
+
+static uint32_t crc_resolve(uint32_t crc, const uint8_t *buf, size_t len){
+	crc_init();
+	return crc_kernel(crc, buf, len);
+}
+
+uint32_t crc_update(uint32_t crc, const void *buf, size_t len){
+	return crc_kernel(crc, (const uint8_t*) buf, len);
+}
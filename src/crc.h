@@ -0,0 +1,33 @@
+#ifndef __CRC_H_
+#define __CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320), bit for bit the
+ * same value as zlib's crc32(). Several kernels are available:
+ * - "pclmul": carry-less multiplication folding (x86 with PCLMULQDQ)
+ * - "slice8": slicing-by-8 lookup tables
+ * - "zlib": plain call to zlib's crc32()
+ */
+
+/* Select the fastest kernel supported by the CPU that passes the self-test
+ * against zlib. Calling it is optional: the first CRC computed triggers it.
+ * Further calls do nothing.
+ */
+void crc_init(void);
+
+/* Returns the name of the selected kernel */
+const char* crc_kernel_name(void);
+
+/* Continue a CRC32 over len more bytes, starting from the value returned by
+ * a previous call (or 0 for a new CRC), exactly like zlib's crc32().
+ */
+uint32_t crc_update(uint32_t crc, const void *buf, size_t len);
+
+/* CRC32 of a whole buffer */
+static inline uint32_t crc_compute(const void *buf, size_t len){
+	return crc_update(0, buf, len);
+}
+
+#endif // __CRC_H_
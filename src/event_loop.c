@@ -0,0 +1,121 @@
+#include "event_loop.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "clock.h"
+#include "socket_helpers.h"
+
+int ev_init(event_loop_t *loop){
+	memset(loop, 0, sizeof(event_loop_t));
+	loop->armed = UINT64_MAX;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(loop->epfd == -1 || loop->tfd == -1){
+		ERROR("Could not create the event loop");
+		ev_destroy(loop);
+		return -1;
+	}
+	/* The timer is the only event without a watch */
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) == -1){
+		ERROR("Could not watch the timer of the event loop");
+		ev_destroy(loop);
+		return -1;
+	}
+	return 0;
+}
+
+void ev_destroy(event_loop_t *loop){
+	if(loop->epfd != -1) close(loop->epfd);
+	if(loop->tfd != -1) close(loop->tfd);
+	loop->epfd = loop->tfd = -1;
+}
+
+int ev_watch(event_loop_t *loop, int fd, uint32_t events, ev_callback_t callback, void *arg){
+	if(loop->n_watches == EV_MAX_WATCHES){
+		ERROR("Too many file descriptors in the event loop");
+		return -1;
+	}
+	ev_watch_t *watch = &loop->watches[loop->n_watches];
+	watch->fd = fd;
+	watch->events = events;
+	watch->callback = callback;
+	watch->arg = arg;
+	struct epoll_event ev = {.events = events, .data.ptr = watch};
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+		ERROR("Could not watch fd %d", fd);
+		return -1;
+	}
+	loop->n_watches++;
+	return 0;
+}
+
+int ev_set_events(event_loop_t *loop, int fd, uint32_t events){
+	for(int i = 0; i < loop->n_watches; i++){
+		ev_watch_t *watch = &loop->watches[i];
+		if(watch->fd != fd) continue;
+		if(watch->events == events) return 0;
+		struct epoll_event ev = {.events = events, .data.ptr = watch};
+		count_syscall();
+		if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1){
+			ERROR("Could not change the events of fd %d", fd);
+			return -1;
+		}
+		watch->events = events;
+		return 0;
+	}
+	return -1;
+}
+
+/* Arm the timerfd for deadline unless it already fires sooner */
+static int ev_arm(event_loop_t *loop, uint64_t deadline){
+	if(deadline >= loop->armed) return 0;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	count_syscall();
+	if(timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1){
+		ERROR("Could not arm the timer of the event loop");
+		return -1;
+	}
+	loop->armed = deadline;
+	return 0;
+}
+
+int ev_run(event_loop_t *loop, uint64_t deadline){
+	int timeout = -1;
+	if(deadline <= clock_us()){
+		timeout = 0;
+	} else if(deadline != UINT64_MAX && ev_arm(loop, deadline)){
+		return -1;
+	}
+	struct epoll_event events[EV_MAX_WATCHES + 1];
+	count_syscall();
+	int n = epoll_wait(loop->epfd, events, EV_MAX_WATCHES + 1, timeout);
+	if(n == -1){
+		if(errno == EINTR) return 0;
+		ERROR("Error with epoll_wait()");
+		return -1;
+	}
+	int run = 0;
+	for(int i = 0; i < n; i++){
+		ev_watch_t *watch = events[i].data.ptr;
+		if(watch == NULL){
+			uint64_t expirations;
+			count_syscall();
+			if(read(loop->tfd, &expirations, sizeof(expirations)) == -1){
+				DEBUG("Event loop timer read before it expired\n");
+			}
+			loop->armed = UINT64_MAX;
+			continue;
+		}
+		watch->callback(watch->fd, events[i].events, watch->arg);
+		run++;
+	}
+	return run;
+}
@@ -0,0 +1,62 @@
+#ifndef __EVENT_LOOP_H_
+#define __EVENT_LOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* File descriptors a loop can watch */
+#define EV_MAX_WATCHES 8
+
+/* Called when the file descriptor of a watch is ready
+ * @events: the EPOLLIN, EPOLLOUT, EPOLLERR... reported by epoll
+ */
+typedef void (*ev_callback_t)(int fd, uint32_t events, void *arg);
+
+typedef struct ev_watch {
+	int fd;
+	uint32_t events;
+	ev_callback_t callback;
+	void *arg;
+} ev_watch_t;
+
+/* Event loop over epoll. Each watched file descriptor comes with its callback, and a single timerfd
+ * wakes the loop up at the deadline given to ev_run(), to the microsecond of clock_us(). The timerfd
+ * is only armed again when the deadline comes sooner than it is armed for: a deadline pushed back
+ * costs one early wake up rather than a system call at every turn.
+ * @armed: deadline the timerfd is armed for, UINT64_MAX if it is not
+ */
+typedef struct event_loop {
+	int epfd;
+	int tfd;
+	uint64_t armed;
+	ev_watch_t watches[EV_MAX_WATCHES];
+	int n_watches;
+} event_loop_t;
+
+/* Create the epoll instance and the timerfd
+ * @return: 0 in case of success, -1 otherwise
+ */
+int ev_init(event_loop_t *loop);
+
+/* Close the file descriptors of the loop, the watched ones are left open */
+void ev_destroy(event_loop_t *loop);
+
+/* Watch fd (level-triggered) and call callback with arg whenever it is ready
+ * @events: EPOLLIN and/or EPOLLOUT, 0 to add it without watching it yet
+ * @return: 0 in case of success, -1 otherwise
+ */
+int ev_watch(event_loop_t *loop, int fd, uint32_t events, ev_callback_t callback, void *arg);
+
+/* Change the events watched on fd, nothing is done if they are the same
+ * @return: 0 in case of success, -1 otherwise
+ */
+int ev_set_events(event_loop_t *loop, int fd, uint32_t events);
+
+/* Wait until a watched file descriptor is ready or deadline, and run the callbacks of the ready ones
+ * @deadline: in microseconds of clock_us(), UINT64_MAX to wait as long as needed, a deadline
+ *            already over only runs the callbacks of the file descriptors ready right now
+ * @return: the number of callbacks run (0 when the wait ended with the deadline or earlier), -1 on errors
+ */
+int ev_run(event_loop_t *loop, uint64_t deadline);
+
+#endif // __EVENT_LOOP_H_
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "log.h"
+#include "packet.h"
+#include "socket_helpers.h"
+#include "clock.h"
+#include "event_loop.h"
+
+/* Link emulator: relays the UDP traffic received on port to [::1]:forward_port and the answers back,
+ * like link_sim and with the same options, plus reordering and a bandwidth cap. Each direction draws
+ * its impairments from its own generator seeded with the seed, so that a seed replays the same
+ * losses, errors and delays on the same sequence of packets whatever the timing of the other direction.
+ */
+
+/* A datagram on its way, released at release */
+typedef struct emu_packet {
+	uint64_t release;
+	uint64_t order;  // Tie-break, packets released at the same time leave in arrival order
+	int dir;
+	size_t len;
+	char *data;
+} emu_packet_t;
+
+/* One direction of the link
+ * @rng: state of its generator
+ * @free_at: clock_us() at which the last packet queued is serialized, with a bandwidth cap
+ */
+typedef struct emu_dir {
+	uint64_t rng;
+	uint64_t free_at;
+	unsigned long forwarded, lost, corrupted, cut, reordered, overflowed;
+} emu_dir_t;
+
+enum { TO_RECEIVER = 0, TO_SENDER = 1 };
+
+/* Impairments, rates in percents of the packets and times in microseconds */
+double loss_rate = 0, err_rate = 0, cut_rate = 0, reorder_rate = 0;
+uint64_t delay = 0, jitter = 0;
+uint64_t bandwidth = 0;          // Bytes per second in each direction, 0 for no cap
+uint64_t queue_limit = 1 << 20;  // Bytes waiting for the link in each direction beyond which packets are dropped
+
+emu_dir_t dirs[2];
+int sock_in;                     // Bound to port, faces the sender
+int sock_out;                    // Faces the receiver, left unconnected so its ICMP errors are not reported
+struct sockaddr_in6 forward;     // [::1]:forward_port
+struct sockaddr_in6 peer;        // Last sender heard of
+bool peer_known = false;
+volatile sig_atomic_t stopped = 0;
+
+/* Pending packets, a binary min-heap on (release, order) */
+emu_packet_t *heap = NULL;
+size_t heap_len = 0, heap_cap = 0;
+uint64_t arrivals = 0;
+
+/* splitmix64: a well mixed 64-bit generator in a single word of state */
+static uint64_t rng_next(uint64_t *state){
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* @return: a uniform double in [0, 1) */
+static double rng_unit(uint64_t *state){
+	return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool heap_before(const emu_packet_t *a, const emu_packet_t *b){
+	return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+static int heap_push(emu_packet_t pkt){
+	if(heap_len == heap_cap){
+		size_t cap = heap_cap ? 2 * heap_cap : 256;
+		emu_packet_t *grown = realloc(heap, cap * sizeof(emu_packet_t));
+		if(grown == NULL){
+			ERROR("Could not queue more packets");
+			return -1;
+		}
+		heap = grown;
+		heap_cap = cap;
+	}
+	size_t i = heap_len++;
+	while(i && heap_before(&pkt, &heap[(i - 1) / 2])){
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = pkt;
+	return 0;
+}
+
+static emu_packet_t heap_pop(){
+	emu_packet_t top = heap[0];
+	emu_packet_t last = heap[--heap_len];
+	size_t i = 0;
+	for(;;){
+		size_t child = 2 * i + 1;
+		if(child >= heap_len) break;
+		if(child + 1 < heap_len && heap_before(&heap[child + 1], &heap[child])) child++;
+		if(!heap_before(&heap[child], &last)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if(heap_len) heap[i] = last;
+	return top;
+}
+
+/* Size of the header of a PTYPE_DATA packet, CRC1 included, 0 for the other types */
+static size_t data_header_size(const char *data, size_t len){
+	uint8_t first = (uint8_t) data[0];
+	if(!(first >> 6)){
+		return len > EXT_HEADER_SIZE && (first & 0x1f) == PTYPE_DATA ? EXT_HEADER_SIZE : 0;
+	}
+	return len > DATA_HEADER_SIZE && (first >> 6) == PTYPE_DATA ? DATA_HEADER_SIZE : 0;
+}
+
+/* Draw the fate of a datagram that just arrived and queue it unless it is lost.
+ * As with link_sim, a corrupted packet is not cut: a bit of it is flipped. A cut packet loses
+ * its payload and gets its TR bit set, the header and its CRC1 are left as they are.
+ */
+static void emulate(int d, const char *data, size_t len){
+	emu_dir_t *dir = &dirs[d];
+	uint64_t *rng = &dir->rng;
+	/* The draws are made whatever the rates, the same seed then gives the same fates when only a rate changes */
+	double lost = rng_unit(rng) * 100, corrupt = rng_unit(rng) * 100, cut = rng_unit(rng) * 100;
+	double reorder = rng_unit(rng) * 100, spread = rng_unit(rng);
+	uint64_t bit = rng_next(rng);
+	if(lost < loss_rate){
+		dir->lost++;
+		return;
+	}
+	/* With a bandwidth cap, the packet waits for the ones before it to be serialized, then for its own */
+	uint64_t now = clock_us();
+	uint64_t sent_at = now;
+	if(bandwidth){
+		if(dir->free_at > now && (dir->free_at - now) * bandwidth / 1000000 > queue_limit){
+			dir->overflowed++;
+			return;
+		}
+		dir->free_at = (dir->free_at > now ? dir->free_at : now) + len * 1000000 / bandwidth;
+		sent_at = dir->free_at;
+	}
+	emu_packet_t pkt = {.order = arrivals++, .dir = d, .len = len, .data = malloc(len)};
+	if(pkt.data == NULL){
+		ERROR("Could not copy a packet");
+		return;
+	}
+	memcpy(pkt.data, data, len);
+	size_t header;
+	if(corrupt < err_rate){
+		pkt.data[(bit >> 3) % len] ^= 1 << (bit & 7);
+		dir->corrupted++;
+	} else if(cut < cut_rate && (header = data_header_size(data, len))){
+		pkt.data[0] |= 0x20;
+		pkt.len = header;
+		dir->cut++;
+	}
+	/* The jitter spreads the delays over [delay - jitter, delay + jitter], which may reorder packets already.
+	 * A reordered packet is held back by one more delay (at least 1 ms) so that the next ones overtake it */
+	int64_t wait = (int64_t) delay + (jitter ? (int64_t) (spread * (2 * jitter + 1)) - (int64_t) jitter : 0);
+	if(reorder < reorder_rate){
+		wait += delay > 1000 ? delay : 1000;
+		dir->reordered++;
+	}
+	pkt.release = sent_at + (wait > 0 ? (uint64_t) wait : 0);
+	if(heap_push(pkt)){
+		free(pkt.data);
+	}
+}
+
+/* Send the packets whose time has come */
+static void release_due(){
+	uint64_t now = clock_us();
+	while(heap_len && heap[0].release <= now){
+		emu_packet_t pkt = heap_pop();
+		ssize_t sent;
+		count_syscall();
+		if(pkt.dir == TO_RECEIVER){
+			sent = sendto(sock_out, pkt.data, pkt.len, 0, (struct sockaddr*) &forward, sizeof(forward));
+		} else {
+			sent = sendto(sock_in, pkt.data, pkt.len, 0, (struct sockaddr*) &peer, sizeof(peer));
+		}
+		if(sent == -1){
+			DEBUG("Could not forward a packet: %s\n", strerror(errno));
+		} else {
+			dirs[pkt.dir].forwarded++;
+		}
+		free(pkt.data);
+	}
+}
+
+/* Take the datagrams waiting on a side of the link
+ * @arg: the direction they go to
+ */
+static void on_datagrams(int fd, uint32_t events, void *arg){
+	(void) events;
+	int d = (int) (intptr_t) arg;
+	static char buffers[BATCH_SIZE][MAX_PKT_SIZE];
+	char *bufs[BATCH_SIZE];
+	for(int i = 0; i < BATCH_SIZE; i++){
+		bufs[i] = buffers[i];
+	}
+	recv_batch_t batch;
+	int n = recv_batch(fd, &batch, bufs, MAX_PKT_SIZE, BATCH_SIZE, MSG_DONTWAIT);
+	for(int i = 0; i < n; i++){
+		if(!batch.msgs[i].msg_len) continue;
+		if(d == TO_RECEIVER){
+			peer = batch.srcs[i];
+			peer_known = true;
+		} else if(!peer_known){
+			continue;
+		}
+		emulate(d, buffers[i], batch.msgs[i].msg_len);
+	}
+}
+
+static void on_signal(int sig){
+	(void) sig;
+	stopped = 1;
+}
+
+int print_usage(char *prog_name){
+	ERROR("Usage:\n\t%s [-p port] [-P forward_port] [-d delay] [-j jitter] [-e err_rate] [-c cut_rate] [-l loss_rate] [-r reorder_rate] [-b rate] [-q queue] [-s seed]", prog_name);
+	ERROR("\tRelays the UDP traffic received on port (default 1341) to [::1]:forward_port (default 12345) and back");
+	ERROR("\t-d, -j: delay and jitter in ms, each packet is delayed by delay + rand[-jitter, jitter]");
+	ERROR("\t-e, -c, -l, -r: rates in packets/100 of corruption, truncation after the header, loss and reordering");
+	ERROR("\t-b: bandwidth of each direction in kB/s, -q: bytes waiting for it beyond which packets are dropped (default %lu)", (unsigned long) queue_limit);
+	ERROR("\t-s: seed of the generators, the impairments of a session are replayed with the same seed (default 1)");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv){
+	int port = 1341, forward_port = 12345;
+	uint64_t seed = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "p:P:d:j:e:c:l:r:b:q:s:h")) != -1){
+		switch(opt){
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			forward_port = atoi(optarg);
+			break;
+		case 'd':
+			delay = (uint64_t) (atof(optarg) * 1000);
+			break;
+		case 'j':
+			jitter = (uint64_t) (atof(optarg) * 1000);
+			break;
+		case 'e':
+			err_rate = atof(optarg);
+			break;
+		case 'c':
+			cut_rate = atof(optarg);
+			break;
+		case 'l':
+			loss_rate = atof(optarg);
+			break;
+		case 'r':
+			reorder_rate = atof(optarg);
+			break;
+		case 'b':
+			bandwidth = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'q':
+			queue_limit = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			return print_usage(argv[0]);
+		}
+	}
+	if(port <= 0 || forward_port <= 0 || optind != argc){
+		return print_usage(argv[0]);
+	}
+	if(jitter > delay){
+		jitter = delay;
+	}
+	dirs[TO_RECEIVER].rng = seed;
+	dirs[TO_SENDER].rng = seed ^ 0x5555555555555555ULL;
+
+	struct sockaddr_in6 addr;
+	const char *err = real_address("::1", &addr);
+	if(err){
+		ERROR("Could not resolve ::1: %s", err);
+		return EXIT_FAILURE;
+	}
+	forward = addr;
+	forward.sin6_port = htons(forward_port);
+	sock_in = create_socket(&addr, port, NULL, -1);
+	sock_out = create_socket(NULL, -1, NULL, -1);
+	if(sock_in == -1 || sock_out == -1){
+		return EXIT_FAILURE;
+	}
+	set_socket_buffers(sock_in, SOCKET_BUFFER_SIZE);
+	set_socket_buffers(sock_out, SOCKET_BUFFER_SIZE);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	event_loop_t loop;
+	if(ev_init(&loop) || ev_watch(&loop, sock_in, EPOLLIN, on_datagrams, (void*) (intptr_t) TO_RECEIVER) ||
+	   ev_watch(&loop, sock_out, EPOLLIN, on_datagrams, (void*) (intptr_t) TO_SENDER)){
+		return EXIT_FAILURE;
+	}
+	while(!stopped){
+		if(ev_run(&loop, heap_len ? heap[0].release : UINT64_MAX) == -1){
+			break;
+		}
+		release_due();
+	}
+	ev_destroy(&loop);
+
+	/* Totals on stderr, one line per direction */
+	const char *names[] = {"to_receiver", "to_sender"};
+	for(int d = 0; d < 2; d++){
+		fprintf(stderr, "%s,forwarded,%lu,lost,%lu,corrupted,%lu,cut,%lu,reordered,%lu,overflowed,%lu\n", names[d],
+		        dirs[d].forwarded, dirs[d].lost, dirs[d].corrupted, dirs[d].cut, dirs[d].reordered, dirs[d].overflowed);
+	}
+	while(heap_len){
+		free(heap_pop().data);
+	}
+	free(heap);
+	close(sock_in);
+	close(sock_out);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include "output.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "socket_helpers.h"
+
+/* Size requested for the pipe when splicing, the default only holds 16 payloads */
+#define OUTPUT_PIPE_SIZE (1 << 20)
+
+int output_open(output_t *out, int fd, int splice){
+	memset(out, 0, sizeof(output_t));
+	out->fd = fd;
+
+	struct stat st;
+	if(!splice || fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)){
+		return 0;
+	}
+
+	// Every spliced payload takes a buffer of the pipe, whatever its size
+	fcntl(fd, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	long page = sysconf(_SC_PAGESIZE);
+	if(size <= 0 || page <= 0){
+		return 0;
+	}
+	out->max_pending = size / page + OUTPUT_MAX_IOV;
+	out->pending = (slot_t**) malloc(out->max_pending * sizeof(slot_t*));
+	out->pending_end = (uint64_t*) malloc(out->max_pending * sizeof(uint64_t));
+	if(out->pending == NULL || out->pending_end == NULL){
+		ERROR("Could not allocate the splice bookkeeping, writing instead");
+		output_close(out);
+		out->fd = fd;
+		return 0;
+	}
+	out->splice = 1;
+	DEBUG("Splicing to stdout, up to %lu pages in the pipe", out->max_pending);
+	return 0;
+}
+
+int output_open_file(output_t *out, const char *path){
+	memset(out, 0, sizeof(output_t));
+	out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out->fd == -1){
+		ERROR("Could not open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	out->positional = 1;
+	return 0;
+}
+
+void output_open_shared(output_t *out, int fd, uint64_t base){
+	memset(out, 0, sizeof(output_t));
+	out->fd = fd;
+	out->positional = 1;
+	out->shared = 1;
+	out->allocated = base / OUTPUT_FILE_CHUNK * OUTPUT_FILE_CHUNK;
+}
+
+void output_close(output_t *out){
+	if(out->positional && !out->shared){
+		// Release the space preallocated past the end of the data
+		if(ftruncate(out->fd, out->size) == -1){
+			ERROR("Could not truncate the output: %s", strerror(errno));
+		}
+		close(out->fd);
+		out->positional = 0;
+	}
+	free(out->pending);
+	free(out->pending_end);
+	out->pending = NULL;
+	out->pending_end = NULL;
+	out->max_pending = 0;
+	out->splice = 0;
+}
+
+/* Give back to the pool the slots whose pages were read out of the pipe */
+static void output_reclaim(output_t *out){
+	int unread;
+	if(!out->n_pending || ioctl(out->fd, FIONREAD, &unread) == -1){
+		return;
+	}
+	uint64_t consumed = out->spliced - unread;
+	while(out->n_pending && out->pending_end[out->head] <= consumed){
+		slot_put(out->pool, out->pending[out->head]);
+		out->head = (out->head + 1) % out->max_pending;
+		out->n_pending--;
+	}
+}
+
+void output_reserve(output_t *out, size_t n){
+	if(!out->splice) return;
+	output_reclaim(out);
+	while(out->pool->n_free < n && out->n_pending){
+		poll(NULL, 0, 1);
+		output_reclaim(out);
+	}
+}
+
+int output_push(output_t *out, const char *buf, size_t len, slot_t *slot){
+	if(!len){
+		if(slot != NULL) slot_put(out->pool, slot);
+		return 0;
+	}
+	out->iov[out->count].iov_base = (void*) buf;
+	out->iov[out->count].iov_len = len;
+	out->owned[out->count] = slot;
+	out->count++;
+	if(out->count == OUTPUT_MAX_IOV){
+		return output_flush(out);
+	}
+	return 0;
+}
+
+int output_push_at(output_t *out, const char *buf, size_t len, uint64_t offset){
+	if(!len) return 0;
+	if(out->count && out->run_offset + out->run_len != offset){
+		if(output_flush(out)) return -1;
+	}
+	if(!out->count){
+		out->run_offset = offset;
+		out->run_len = 0;
+	}
+
+	// Reserve the blocks ahead of the data, KEEP_SIZE lets the size follow what is written
+	if(offset + len > out->allocated){
+		uint64_t end = (offset + len + OUTPUT_FILE_CHUNK - 1) / OUTPUT_FILE_CHUNK * OUTPUT_FILE_CHUNK;
+		if(fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out->allocated, end - out->allocated) == -1 && errno != EOPNOTSUPP){
+			DEBUG("fallocate() failed: %s", strerror(errno));
+		}
+		out->allocated = end;
+	}
+	if(offset + len > out->size){
+		out->size = offset + len;
+	}
+
+	out->iov[out->count].iov_base = (void*) buf;
+	out->iov[out->count].iov_len = len;
+	out->owned[out->count] = NULL;
+	out->count++;
+	out->run_len += len;
+	if(out->count == OUTPUT_MAX_IOV){
+		return output_flush(out);
+	}
+	return 0;
+}
+
+int output_flush(output_t *out){
+	uint64_t offset = out->run_offset;
+	int ret = 0;
+	int done = 0;
+	while(done < out->count){
+		ssize_t n;
+		if(out->ring != NULL && !out->splice){
+			n = uring_writev(out->ring, out->fd, out->iov + done, out->count - done, out->positional ? (int64_t) offset : -1);
+			if(out->positional) offset += n > 0 ? n : 0;
+		} else if(out->splice){
+			count_syscall();
+			n = vmsplice(out->fd, out->iov + done, out->count - done, 0);
+		} else if(out->positional){
+			count_syscall();
+			n = pwritev(out->fd, out->iov + done, out->count - done, offset);
+			offset += n > 0 ? n : 0;
+		} else {
+			count_syscall();
+			n = writev(out->fd, out->iov + done, out->count - done);
+		}
+		if(n == -1){
+			if(errno == EINTR) continue;
+			ERROR("Error while writing to the output: %s", strerror(errno));
+			ret = -1;
+			break;
+		}
+		out->spliced += n;
+		// Skip what was fully written, and keep the rest of a partially written payload
+		while(done < out->count && (size_t) n >= out->iov[done].iov_len){
+			n -= out->iov[done].iov_len;
+			done++;
+		}
+		if(n){
+			out->iov[done].iov_base = (char*) out->iov[done].iov_base + n;
+			out->iov[done].iov_len -= n;
+		}
+	}
+
+	for(int i = 0; i < out->count; i++){
+		if(out->owned[i] == NULL) continue;
+		if(out->splice && ret == 0){
+			// The pipe still references the page until the reader consumes it
+			if(out->n_pending == out->max_pending){
+				output_reserve(out, out->pool->n_free + 1);
+			}
+			size_t tail = (out->head + out->n_pending) % out->max_pending;
+			out->pending[tail] = out->owned[i];
+			out->pending_end[tail] = out->spliced;
+			out->n_pending++;
+		} else {
+			slot_put(out->pool, out->owned[i]);
+		}
+	}
+	out->count = 0;
+	out->run_offset = offset;
+	out->run_len = 0;
+	return ret;
+}
@@ -0,0 +1,99 @@
+#ifndef __OUTPUT_H_
+#define __OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "slot_pool.h"
+#include "uring.h"
+
+/* Maximum number of payloads gathered before the output is flushed */
+#define OUTPUT_MAX_IOV (N + BATCH_SIZE)
+
+/* Space preallocated at once in front of the data written to a file */
+#define OUTPUT_FILE_CHUNK (16 << 20)
+
+/* Payloads delivered in order, written to a file descriptor with a single
+ * writev() per flush. When the file descriptor is a pipe, the pages can be
+ * handed to the reader with vmsplice() instead: the slots are then only given
+ * back to the pool once the reader consumed them.
+ * An output opened on a file is positional instead: payloads are written at
+ * their own offset as soon as they arrive, consecutive ones with one pwritev().
+ * When ring is set, the writes go through it instead, along with the requests queued on it.
+ */
+typedef struct output {
+	int fd;
+	int splice;
+	int positional;
+	int shared;             /* The fd belongs to someone else, it is neither truncated nor closed (positional only) */
+	uint64_t run_offset;    /* Offset of the queued payloads (positional only) */
+	uint64_t run_len;       /* Total length of the queued payloads (positional only) */
+	uint64_t size;          /* End of the furthest payload written (positional only) */
+	uint64_t allocated;     /* Bytes preallocated with fallocate() (positional only) */
+	slot_pool_t *pool;
+	uring_t *ring;          /* Ring to write through, NULL to call the system calls (never when splicing) */
+	struct iovec iov[OUTPUT_MAX_IOV];
+	slot_t *owned[OUTPUT_MAX_IOV]; /* Slot to release once iov[i] is written, or NULL */
+	int count;
+
+	/* vmsplice() bookkeeping: FIFO of the slots still referenced by the pipe */
+	uint64_t spliced;       /* Bytes handed to the pipe so far */
+	slot_t **pending;
+	uint64_t *pending_end;  /* Value of spliced once the slot was handed over */
+	size_t max_pending;
+	size_t head;
+	size_t n_pending;
+} output_t;
+
+/* Prepare the output on fd
+ * @splice: if non-zero and fd is a pipe, pages are spliced instead of copied
+ * @return: 0 in case of success, -1 otherwise
+ * @post: out->max_pending is the number of extra slots the pool needs for the pages
+ *        referenced by the pipe (0 when not splicing)
+ */
+int output_open(output_t *out, int fd, int splice);
+
+/* Prepare a positional output on a new file at path, see output_push_at()
+ * @return: 0 in case of success, -1 otherwise
+ */
+int output_open_file(output_t *out, const char *path);
+
+/* Prepare a positional output on a file that several outputs write to, each at its own offsets.
+ * The file is neither truncated nor closed by output_close(), out->size tells how far this output wrote.
+ * @base: first offset this output writes at, the space is preallocated from there
+ */
+void output_open_shared(output_t *out, int fd, uint64_t base);
+
+/* Release the memory of the output, after a last flush.
+ * A positional output is truncated to the end of its furthest payload and closed.
+ */
+void output_close(output_t *out);
+
+/* Queue a payload, the output is flushed when it is full
+ * @slot: slot holding the payload, given back to out->pool once the payload has been
+ *        written (or consumed by the reader when splicing). NULL if the caller keeps the
+ *        buffer, which must then stay untouched until the next flush.
+ * @return: 0 in case of success, -1 if a flush failed
+ */
+int output_push(output_t *out, const char *buf, size_t len, slot_t *slot);
+
+/* Queue a payload to be written at offset in a positional output. The buffer must
+ * stay untouched until the next flush. The output is flushed when it is full or when
+ * the payload does not directly follow the queued ones.
+ * @return: 0 in case of success, -1 if a flush failed
+ */
+int output_push_at(output_t *out, const char *buf, size_t len, uint64_t offset);
+
+/* Write all the queued payloads
+ * @return: 0 in case of success, -1 otherwise
+ */
+int output_flush(output_t *out);
+
+/* Block until the pool has at least n free slots, by waiting for the
+ * reader of the pipe to consume spliced pages. Does nothing when not splicing.
+ */
+void output_reserve(output_t *out, size_t n);
+
+#endif // __OUTPUT_H_
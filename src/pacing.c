@@ -0,0 +1,42 @@
+#include "pacing.h"
+
+#include <string.h>
+
+#define SCALE 1000000
+
+void pacer_init(pacer_t *pacer, uint64_t burst, uint64_t now){
+	memset(pacer, 0, sizeof(pacer_t));
+	pacer->burst = burst;
+	pacer->tokens = burst * SCALE;
+	pacer->last = now;
+}
+
+void pacer_set_rate(pacer_t *pacer, uint64_t rate){
+	pacer->rate = rate;
+}
+
+bool pacer_ready(pacer_t *pacer, size_t len, uint64_t now){
+	if(!pacer->rate){
+		return true;
+	}
+	pacer->tokens += (now - pacer->last) * pacer->rate;
+	if(pacer->tokens > pacer->burst * SCALE){
+		pacer->tokens = pacer->burst * SCALE;
+	}
+	pacer->last = now;
+
+	uint64_t needed = (uint64_t) len * SCALE;
+	if(pacer->tokens >= needed){
+		return true;
+	}
+	pacer->wake = now + (needed - pacer->tokens + pacer->rate - 1) / pacer->rate;
+	return false;
+}
+
+void pacer_consume(pacer_t *pacer, size_t len){
+	if(!pacer->rate){
+		return;
+	}
+	uint64_t used = (uint64_t) len * SCALE;
+	pacer->tokens = pacer->tokens > used ? pacer->tokens - used : 0;
+}
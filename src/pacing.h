@@ -0,0 +1,38 @@
+#ifndef __PACING_H_
+#define __PACING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Token bucket spreading the packets at a given rate. The bucket holds at most burst bytes,
+ * so that an idle sender does not get to send a whole window at once when it resumes.
+ * @wake: clock_us() at which the packet last held back by pacer_ready() may leave
+ * @rate: bytes per second, 0 when pacing is off
+ * @tokens: available bytes, scaled by 1000000 so that the refill of a microsecond is exact
+ * @burst: size of the bucket, in bytes
+ * @last: clock_us() of the last refill
+ */
+typedef struct pacer {
+	uint64_t wake;
+	uint64_t rate;
+	uint64_t tokens;
+	uint64_t burst;
+	uint64_t last;
+} pacer_t;
+
+/* Start with a full bucket, pacing is off until a rate is set */
+void pacer_init(pacer_t *pacer, uint64_t burst, uint64_t now);
+
+/* Change the rate (in bytes per second), 0 turns pacing off */
+void pacer_set_rate(pacer_t *pacer, uint64_t rate);
+
+/* Check if a packet of len bytes may leave now. If not, wake is set to the time at which it
+ * may, the caller should stop sending until then.
+ */
+bool pacer_ready(pacer_t *pacer, size_t len, uint64_t now);
+
+/* Take the tokens of a packet of len bytes that was just sent */
+void pacer_consume(pacer_t *pacer, size_t len);
+
+#endif // __PACING_H_
@@ -2,9 +2,12 @@
 
 /* Extra #includes */
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <zlib.h>
+#include <endian.h>
+
+#include "crc.h"
 
 const char *STATUS_CODE_STR[] = {"PKT_OK", "E_TYPE", "E_TR", "E_LENGTH", "E_CRC", "E_WINDOW", "E_SEQNUM", "E_NOMEM", "E_NOHEADER", "E_UNCONSISTENT"};
 
@@ -40,143 +43,246 @@ void check_errors(uint8_t* errs, uint8_t len){
 	}
 }
 
-uLong compute_crc(Bytef* buf, size_t sz){
-	uLong crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, buf, sz);
-	return crc;
-}
-
-pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt)
+/* Decode the extended format, see EXT_HEADER_SIZE */
+static pkt_status_code pkt_decode_view_ext(const char *data, const size_t len, pkt_view_t *view)
 {
-	uint8_t ret[6];
+	uint8_t first = (uint8_t) data[0];
+	view->ext = 1;
+	view->tr = (first >> 5) & 1;
+	view->type = first & 0x1f;
+	if(!view->type || view->type > PTYPE_REPAIR) {
+		return E_TYPE;
+	}
+	if(EXT_HEADER_SIZE > len) {
+		return E_NOHEADER;
+	}
+
+	uint16_t length;
+	uint32_t window, seqnum, crc1;
+	view->flags = (uint8_t) data[1];
+	memcpy(&length, data+2, 2);
+	view->length = ntohs(length);
+	if(view->length > EXT_MAX_PAYLOAD_SIZE) {
+		return E_LENGTH;
+	}
+	memcpy(&window, data+4, 4);
+	view->window = ntohl(window);
+	memcpy(&seqnum, data+8, 4);
+	view->seqnum = ntohl(seqnum);
+	memcpy(&view->timestamp, data+12, 4);
+	memcpy(&crc1, data+16, 4);
+	view->crc1 = ntohl(crc1);
+	view->crc2 = 0;
+	view->payload = NULL;
+
+	bool has_payload = view->length && !view->tr;
+	if(len != EXT_HEADER_SIZE + (has_payload ? (size_t) view->length + 4 : 0)){
+		return E_UNCONSISTENT;
+	}
+	if(view->tr && view->length != 0){
+		return E_UNCONSISTENT;
+	}
+
+	// The header CRC is computed with TR set to 0
+	uint8_t header[EXT_HEADER_SIZE - 4];
+	memcpy(header, data, sizeof(header));
+	header[0] &= ~0x20;
+	if(crc_compute(header, sizeof(header)) != view->crc1){
+		return E_CRC;
+	}
+
+	if(has_payload){
+		uint32_t crc2;
+		memcpy(&crc2, data+EXT_HEADER_SIZE+view->length, 4);
+		view->crc2 = ntohl(crc2);
+		view->payload = data+EXT_HEADER_SIZE;
+		if(crc_compute(view->payload, view->length) != view->crc2){
+			return E_CRC;
+		}
+	}
 
-	pkt_t* pkt_tmp = pkt_new();
-	memcpy(pkt_tmp, (pkt_t*) data, sizeof(pkt_t));
+	return PKT_OK;
+}
 
-	if((size_t)predict_header_length(pkt_tmp) > len) {
-		return E_NOHEADER; 
+pkt_status_code pkt_decode_view(const char *data, const size_t len, pkt_view_t *view)
+{
+	if(len < 1) {
+		return E_NOHEADER;
 	}
 
-	// Set common struct fields to check for errors in the header
-	ret[0] = pkt_set_type(pkt_tmp, pkt_tmp->type);
-	ret[1] = pkt_set_tr(pkt_tmp, pkt_tmp->tr); // Not necessary, but left for clarity
-	ret[2] = pkt_set_window(pkt_tmp, pkt_tmp->window);
-	uint16_t offset = 0;
-	if(pkt_tmp->type == 1) {
+	// First byte: TYPE (2 bits), TR (1 bit), WINDOW (5 bits)
+	uint8_t first = (uint8_t) data[0];
+	if(!(first >> 6)) {
+		return pkt_decode_view_ext(data, len, view);
+	}
+	view->type = first >> 6;
+	view->tr = (first >> 5) & 1;
+	view->window = first & 0x1f;
+	view->ext = 0;
+	view->flags = 0;
+
+	// Only PTYPE_DATA packets carry the length field
+	size_t offset = 0;
+	if(view->type == PTYPE_DATA) {
 		offset = 2;
 	}
-	ret[3] = pkt_set_seqnum(pkt_tmp, *(data+1+offset));
-	ret[4] = pkt_set_timestamp(pkt_tmp,*(uint32_t*)(data+2+offset));
-	ret[5] = pkt_set_crc1(pkt_tmp, ntohl(*(uint32_t*)(data+6+offset)));
-	
-	// If there are errors, return the first one encountered
-	check_errors(ret, 6);
-	if(ret[0]){
-	  	fprintf(stderr, "Error: %s\n", STATUS_CODE_STR[ret[0]]);
-  	  	return ret[0];	
+	size_t header_len = 6 + offset;
+	if(header_len + 4 > len) {
+		return E_NOHEADER;
 	}
 
-	// Prepare to check CRC1 as well as the size of the data received
-	uLong original_crc = (uLong) pkt_get_crc1(pkt_tmp); 
-	uLong crc;
-	uint8_t old_tr = pkt_tmp->tr;
-	pkt_tmp->tr = 0;
-	uint16_t total;
-	if(pkt_tmp->type == 1) {
-		crc = compute_crc((Bytef*)pkt_tmp, 8);
-		// Set length to the right endianness
-		ret[0] = pkt_set_length(pkt_tmp, ntohs(pkt_tmp->length));
-		if(ret[0]) {
-			return ret[0];
+	uint16_t length = 0;
+	if(view->type == PTYPE_DATA) {
+		memcpy(&length, data+1, 2);
+		length = ntohs(length);
+		if(length > MAX_PAYLOAD_SIZE) {
+			return E_LENGTH;
 		}
-		total = !old_tr ? 12 + pkt_tmp->length + 4 : 12;
-	}else{
-		Bytef header[6];
-		memcpy(header, pkt_tmp, 1);
-		memcpy(header+1, &pkt_tmp->seqnum, 5);
-		crc = compute_crc(header, 6);
-		total = 10;
 	}
+	view->length = length;
+	view->seqnum = (uint8_t) data[1+offset];
+	memcpy(&view->timestamp, data+2+offset, 4);
+	uint32_t crc1;
+	memcpy(&crc1, data+header_len, 4);
+	view->crc1 = ntohl(crc1);
+	view->crc2 = 0;
+	view->payload = NULL;
 
 	// Check if the given length is consistent
+	size_t total;
+	if(view->type == PTYPE_DATA) {
+		total = !view->tr ? 12 + length + 4 : 12;
+	}else{
+		total = 10;
+	}
 	if(total != len){
-	  	return E_UNCONSISTENT;
+		return E_UNCONSISTENT;
 	}
 	// Checks if packet type is PTYPE_DATA then verify consistency
-	if(pkt_tmp->type == 1 && pkt_tmp->tr && pkt_tmp->length != 0){
-	  	return E_UNCONSISTENT;
+	if(view->type == PTYPE_DATA && view->tr && length != 0){
+		return E_UNCONSISTENT;
 	}
-	// Checks if the crc is correct
-	if(crc != original_crc){
-	  	return E_CRC;
+
+	// The header CRC is computed with TR set to 0
+	uint8_t header[8];
+	memcpy(header, data, header_len);
+	header[0] &= ~0x20;
+	if(crc_compute(header, header_len) != view->crc1){
+		return E_CRC;
 	}
 
-	// Initializing common fields
-	pkt->window = pkt_tmp->window;
-	pkt->tr = old_tr;
-	pkt->type = pkt_tmp->type;
-	pkt->seqnum = pkt_tmp->seqnum;
-	pkt->timestamp = pkt_tmp->timestamp;
-	pkt->crc1 = pkt_tmp->crc1;
-	
-	if(pkt_tmp->type==1 && !old_tr){
-		// Setting the payload and the crc, adding the corresponding offset based on the data pointer
-		offset = 12;
-		ret[0] = pkt_set_payload(pkt_tmp, data+offset, pkt_tmp->length);
-		offset += pkt_tmp->length;
-		ret[1] = pkt_set_crc2(pkt_tmp, ntohl(*(uint32_t*)(data+offset)));
-
-		check_errors(ret, 2);
-		if(ret[0]){
-		  	return ret[0];	
+	if(view->type == PTYPE_DATA && !view->tr){
+		uint32_t crc2;
+		memcpy(&crc2, data+12+length, 4);
+		view->crc2 = ntohl(crc2);
+		view->payload = data+12;
+		if(crc_compute(view->payload, length) != view->crc2){
+			return E_CRC;
 		}
+	}
 
-		// Checks for the CRC2
-		original_crc = (uLong) pkt_get_crc2(pkt_tmp); 
-		crc = compute_crc((Bytef*)pkt_tmp->payload, pkt_tmp->length);
-
-		if(crc != original_crc){
-		  	return E_CRC;
-		}
+	return PKT_OK;
+}
 
-		pkt->length = pkt_tmp->length;
-		pkt->payload = pkt_tmp->payload;
-		pkt->crc2 = pkt_tmp->crc2;
+pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt)
+{
+	pkt_view_t view;
+	pkt_status_code ret = pkt_decode_view(data, len, &view);
+	if(ret){
+		return ret;
 	}
 
-	free(pkt_tmp);
+	// Initializing common fields
+	pkt->window = view.window;
+	pkt->tr = view.tr;
+	pkt->type = view.type;
+	pkt->ext = view.ext;
+	pkt->flags = view.flags;
+	pkt->seqnum = view.seqnum;
+	pkt->timestamp = view.timestamp;
+	pkt->crc1 = view.crc1;
+
+	if(view.payload != NULL){
+		ret = pkt_set_payload(pkt, view.payload, view.length);
+		if(ret){
+			return ret;
+		}
+		pkt->crc2 = view.crc2;
+	}
 
 	return PKT_OK;
 }
 
 
-pkt_status_code pkt_encode(const pkt_t* pkt, char *buf, size_t *len)
+pkt_status_code pkt_encode_header(const pkt_t* pkt, char *buf, size_t *len)
 {
-	size_t total = predict_header_length(pkt); 
-	total += pkt->type == 1 && !pkt->tr ? 4 + pkt->length + 4 : 4; 
-	if(total > *len) return E_NOMEM;
-	
-	memcpy(buf, pkt, 1);
-	size_t offset = 1;
+	ssize_t header_len = predict_header_length(pkt);
+	if(header_len < 0) return E_TYPE;
+	if((size_t) header_len + 4 > *len) return E_NOMEM;
 
-	if(pkt->type==1) {
+	size_t offset;
+	if(pkt->ext) {
 		uint16_t length = htons(pkt->length);
-		memcpy(buf+offset, &length, 2);
-		offset+=2;
+		uint32_t window = htonl(pkt->window);
+		uint32_t seqnum = htonl(pkt->seqnum);
+		buf[0] = pkt->tr << 5 | pkt->type;
+		buf[1] = pkt->flags;
+		memcpy(buf+2, &length, 2);
+		memcpy(buf+4, &window, 4);
+		memcpy(buf+8, &seqnum, 4);
+		memcpy(buf+12, &pkt->timestamp, 4);
+		offset = 16;
+	} else {
+		buf[0] = pkt->type << 6 | pkt->tr << 5 | pkt->window;
+		offset = 1;
+		if(pkt->type==1) {
+			uint16_t length = htons(pkt->length);
+			memcpy(buf+offset, &length, 2);
+			offset+=2;
+		}
+		buf[offset++] = pkt->seqnum;
+		memcpy(buf+offset, &pkt->timestamp, 4);
+		offset+=4;
 	}
 
-	memcpy(buf+offset, &pkt->seqnum, 5);
-	offset+=5;
-
-	uint32_t crc = htonl(compute_crc((Bytef*)buf, offset));
+	uint32_t crc = htonl(crc_compute(buf, offset));
 	memcpy(buf+offset, &crc, 4);
 	offset+=4;
 
-	if(pkt->type==1 && !pkt->tr){
-		memcpy(buf+offset, pkt->payload, pkt->length);
+	*len=offset;
+
+	return PKT_OK;
+}
+
+void pkt_encode_crc2(const pkt_t* pkt, char *buf)
+{
+	uint32_t crc = htonl(crc_compute(pkt->payload, pkt->length));
+	memcpy(buf, &crc, 4);
+}
+
+/* The original format always carries the CRC2 of a non truncated PTYPE_DATA, even without payload */
+static bool pkt_has_crc2(const pkt_t* pkt)
+{
+	if(pkt->tr) return false;
+	return pkt->ext ? pkt->length != 0 : pkt->type == PTYPE_DATA;
+}
+
+pkt_status_code pkt_encode(const pkt_t* pkt, char *buf, size_t *len)
+{
+	ssize_t total = predict_packet_length(pkt);
+	if(total < 0) return E_TYPE;
+	if((size_t) total > *len) return E_NOMEM;
+	
+	size_t offset = *len;
+	pkt_encode_header(pkt, buf, &offset);
+
+	if(pkt_has_crc2(pkt)){
+		// The payload may already sit at its place in the buffer
+		if(pkt->payload != buf+offset){
+			memcpy(buf+offset, pkt->payload, pkt->length);
+		}
 		offset+=pkt->length;
-		crc = htonl(compute_crc((Bytef*)pkt->payload, pkt->length));
-		memcpy(buf+offset, &crc, 4);
+		pkt_encode_crc2(pkt, buf+offset);
 		offset+=4;
 	}
 
@@ -195,12 +301,17 @@ uint8_t  pkt_get_tr(const pkt_t* pkt)
 	return pkt->tr;
 }
 
-uint8_t  pkt_get_window(const pkt_t* pkt)
+uint8_t  pkt_get_ext(const pkt_t* pkt)
+{
+	return pkt->ext;
+}
+
+uint32_t pkt_get_window(const pkt_t* pkt)
 {
 	return pkt->window;
 }
 
-uint8_t  pkt_get_seqnum(const pkt_t* pkt)
+uint32_t pkt_get_seqnum(const pkt_t* pkt)
 {
 	return pkt->seqnum;
 }
@@ -233,7 +344,7 @@ const char* pkt_get_payload(const pkt_t* pkt)
 
 pkt_status_code pkt_set_type(pkt_t *pkt, const ptypes_t type)
 {
-	if(!type) return E_TYPE;
+	if(!type || type > PTYPE_REPAIR) return E_TYPE;
 	pkt->type = type;
 	return PKT_OK;
 }
@@ -244,22 +355,29 @@ pkt_status_code pkt_set_tr(pkt_t *pkt, const uint8_t tr)
 	return PKT_OK;
 }
 
-pkt_status_code pkt_set_window(pkt_t *pkt, const uint8_t window)
+pkt_status_code pkt_set_ext(pkt_t *pkt, const uint8_t ext)
 {
-	if(window > MAX_WINDOW_SIZE) return E_WINDOW;
+	pkt->ext = ext ? 1 : 0;
+	return PKT_OK;
+}
+
+pkt_status_code pkt_set_window(pkt_t *pkt, const uint32_t window)
+{
+	if(!pkt->ext && window > MAX_WINDOW_SIZE) return E_WINDOW;
 	pkt->window = window;
 	return PKT_OK;
 }
 
-pkt_status_code pkt_set_seqnum(pkt_t *pkt, const uint8_t seqnum)
+pkt_status_code pkt_set_seqnum(pkt_t *pkt, const uint32_t seqnum)
 {
+	if(!pkt->ext && seqnum > UINT8_MAX) return E_SEQNUM;
 	pkt->seqnum = seqnum;
 	return PKT_OK;
 }
 
 pkt_status_code pkt_set_length(pkt_t *pkt, const uint16_t length)
 {
-	if(length > MAX_PAYLOAD_SIZE) return E_LENGTH;
+	if(length > (pkt->ext ? EXT_MAX_PAYLOAD_SIZE : MAX_PAYLOAD_SIZE)) return E_LENGTH;
 	pkt->length = length;
 	return PKT_OK;
 }
@@ -288,6 +406,7 @@ pkt_status_code pkt_set_payload(pkt_t *pkt,
 {
 	uint16_t ret = pkt_set_length(pkt, length);
 	if(ret) return ret;
+	free(pkt->payload);
 	pkt->payload = (char*) malloc(length*sizeof(char));
 	if(pkt->payload==NULL) return E_NOMEM;
 	memcpy(pkt->payload, data, length);
@@ -296,13 +415,122 @@ pkt_status_code pkt_set_payload(pkt_t *pkt,
 
 ssize_t predict_header_length(const pkt_t *pkt)
 {
-	if(pkt_get_type(pkt)==0) return E_TYPE;
+	if(pkt_get_type(pkt)==0) return -1;
+	if(pkt->ext) return EXT_HEADER_SIZE - 4;
+	if(pkt_get_type(pkt) > PTYPE_NACK) return -1;
 	if(pkt_get_type(pkt)==1) return 8;
 	else{
 		return 6;
 	}
 }
 
+ssize_t predict_packet_length(const pkt_t *pkt)
+{
+	ssize_t header_len = predict_header_length(pkt);
+	if(header_len < 0) return -1;
+	return header_len + 4 + (pkt_has_crc2(pkt) ? pkt->length + 4 : 0);
+}
+
+size_t hello_encode_opts(const hello_opts_t *opts, char *buf)
+{
+	size_t offset = 0;
+	const struct {
+		hello_opt_t type;
+		uint16_t value;
+	} opts16[] = {
+		{HELLO_OPT_MAX_PAYLOAD, opts->max_payload},
+		{HELLO_OPT_PAYLOAD, opts->payload},
+	};
+	for(size_t i=0; i<sizeof(opts16)/sizeof(opts16[0]); i++){
+		if(!opts16[i].value) continue;
+		uint16_t value = htons(opts16[i].value);
+		buf[offset] = opts16[i].type;
+		buf[offset+1] = 2;
+		memcpy(buf+offset+2, &value, 2);
+		offset += 4;
+	}
+	if(opts->stripes){
+		uint32_t id = htonl(opts->stripe_id);
+		uint16_t stripes = htons(opts->stripes), stripe = htons(opts->stripe);
+		uint64_t stripe_offset = htobe64(opts->stripe_offset);
+		buf[offset] = HELLO_OPT_STRIPE;
+		buf[offset+1] = 16;
+		memcpy(buf+offset+2, &id, 4);
+		memcpy(buf+offset+6, &stripes, 2);
+		memcpy(buf+offset+8, &stripe, 2);
+		memcpy(buf+offset+10, &stripe_offset, 8);
+		offset += 18;
+	}
+	const struct {
+		hello_opt_t type;
+		uint8_t value;
+	} opts8[] = {
+		{HELLO_OPT_COMPRESS, opts->compress},
+		{HELLO_OPT_FEC, opts->fec},
+	};
+	for(size_t i=0; i<sizeof(opts8)/sizeof(opts8[0]); i++){
+		if(!opts8[i].value) continue;
+		buf[offset] = opts8[i].type;
+		buf[offset+1] = 1;
+		buf[offset+2] = opts8[i].value;
+		offset += 3;
+	}
+	return offset;
+}
+
+pkt_status_code hello_decode_opts(const char *buf, size_t len, hello_opts_t *opts)
+{
+	memset(opts, 0, sizeof(hello_opts_t));
+	size_t offset = 0;
+	while(offset + 2 <= len && buf[offset] != HELLO_OPT_END){
+		uint8_t type = buf[offset];
+		uint8_t opt_len = buf[offset+1];
+		offset += 2;
+		if(offset + opt_len > len) return E_LENGTH;
+
+		uint16_t value;
+		if(opt_len == 2){
+			memcpy(&value, buf+offset, 2);
+			value = ntohs(value);
+			if(type == HELLO_OPT_MAX_PAYLOAD) opts->max_payload = value;
+			else if(type == HELLO_OPT_PAYLOAD) opts->payload = value;
+		} else if(type == HELLO_OPT_STRIPE && opt_len == 16){
+			uint32_t id;
+			uint16_t stripes, stripe;
+			uint64_t stripe_offset;
+			memcpy(&id, buf+offset, 4);
+			memcpy(&stripes, buf+offset+4, 2);
+			memcpy(&stripe, buf+offset+6, 2);
+			memcpy(&stripe_offset, buf+offset+8, 8);
+			opts->stripe_id = ntohl(id);
+			opts->stripes = ntohs(stripes);
+			opts->stripe = ntohs(stripe);
+			opts->stripe_offset = be64toh(stripe_offset);
+		} else if(opt_len == 1){
+			if(type == HELLO_OPT_COMPRESS) opts->compress = buf[offset];
+			else if(type == HELLO_OPT_FEC) opts->fec = buf[offset];
+		}
+		offset += opt_len;
+	}
+	return PKT_OK;
+}
+
+void repair_xor(char *dest, const char *src, size_t length)
+{
+	// 64 bits at a time, the memcpy() become plain loads and stores
+	size_t i = 0;
+	for(; i + 8 <= length; i += 8){
+		uint64_t a, b;
+		memcpy(&a, dest+i, 8);
+		memcpy(&b, src+i, 8);
+		a ^= b;
+		memcpy(dest+i, &a, 8);
+	}
+	for(; i < length; i++){
+		dest[i] ^= src[i];
+	}
+}
+
 /*int main(int argc, char* argv[]){
 
 	printf("%d - %s\n", argc, argv[1]);
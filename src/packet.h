@@ -21,21 +21,48 @@ struct pkt_stat {
 	int max_rtt;
 	int packet_retransmitted;
 	int packet_duplicated;
+	int fast_retransmits;
+	int repairs_sent;
+	int packets_recovered;
 };
 
 /* Raccourci pour struct pkt */
 typedef struct pkt pkt_t;
 
-struct __attribute__((__packed__)) pkt {
-	uint8_t window:5;
-	uint8_t tr:1;
-	uint8_t type:2;
+struct pkt {
+	uint8_t type;
+	uint8_t tr;
+	uint8_t ext;       /* Encode au format etendu, voir EXT_HEADER_SIZE */
+	uint8_t flags;     /* Format etendu uniquement */
 	uint16_t length;
-	uint8_t seqnum;
-	unsigned int timestamp;
-	unsigned int crc1;
+	uint32_t window;
+	uint32_t seqnum;
+	uint32_t timestamp;
+	uint32_t crc1;
 	char* payload;
-	unsigned int crc2;
+	uint32_t crc2;
+};
+
+/* Raccourci pour struct pkt_view */
+typedef struct pkt_view pkt_view_t;
+
+/* Vue en lecture seule sur un paquet recu. Les champs du header sont
+ * dans l'endianness native de la machine et le payload pointe directement
+ * dans le buffer de reception: aucune allocation ni copie n'est faite.
+ * La vue n'est valide que tant que le buffer decode n'est pas modifie.
+ */
+struct pkt_view {
+	uint8_t type;
+	uint8_t tr;
+	uint8_t ext;
+	uint8_t flags;
+	uint32_t window;
+	uint32_t seqnum;
+	uint16_t length;
+	uint32_t timestamp;
+	uint32_t crc1;
+	uint32_t crc2;
+	const char *payload; /* NULL s'il n'y a pas de payload */
 };
 
 /* Types de paquets */
@@ -43,13 +70,110 @@ typedef enum {
     PTYPE_DATA = 1,
     PTYPE_ACK = 2,
     PTYPE_NACK = 3,
+    PTYPE_HELLO = 4, /* Negociation du format etendu, format etendu uniquement */
+    PTYPE_PROBE = 5, /* Sonde de path MTU, format etendu uniquement */
+    PTYPE_REPAIR = 6, /* Reparation d'un groupe FEC, format etendu uniquement, voir REPAIR_HEADER_SIZE */
 } ptypes_t;
 
 /* Taille maximale permise pour le payload */
 #define MAX_PAYLOAD_SIZE 512
+/* Taille du header d'un paquet PTYPE_DATA, CRC1 compris: le payload
+ * commence a cet offset dans le paquet encode */
+#define DATA_HEADER_SIZE 12
 /* Taille maximale de Window */
 #define MAX_WINDOW_SIZE 31
 
+/* Format etendu, negocie par un echange de paquets PTYPE_HELLO. Le champ
+ * Type vaut 0 et le vrai type est code dans les 5 bits de Window:
+ *   octet 0       : 00 | TR (1 bit) | Type (5 bits)
+ *   octet 1       : Flags
+ *   octets 2-3    : Length (network byte-order), present pour tous les types
+ *   octets 4-7    : Window (network byte-order)
+ *   octets 8-11   : Seqnum (network byte-order)
+ *   octets 12-15  : Timestamp
+ *   octets 16-19  : CRC1, calcule avec TR a 0
+ * Le payload suit et n'est accompagne d'un CRC2 que si Length est non nul.
+ */
+#define EXT_HEADER_SIZE 20
+/* Flags d'un paquet PTYPE_DATA au format etendu */
+#define PKT_FLAG_DEFLATE 0x01 /* Le payload est compresse en deflate brut (RFC 1951), independamment
+                               * des autres paquets. Une fois decompresse, il ne depasse pas la taille
+                               * des payloads negociee. N'est utilise qu'apres HELLO_OPT_COMPRESS */
+#define PKT_FLAG_FEC 0x02     /* Le paquet fait partie d'un groupe FEC dont Window est le numero.
+                               * N'est utilise qu'apres HELLO_OPT_FEC */
+
+/* Correction d'erreurs (FEC): le sender ferme chaque groupe de paquets PTYPE_DATA consecutifs
+ * marques PKT_FLAG_FEC par un paquet PTYPE_REPAIR, dont le receiver reconstruit le seul paquet
+ * du groupe qui lui manque sans attendre de retransmission. Dans un PTYPE_REPAIR:
+ *   Seqnum        : premier paquet du groupe
+ *   Window        : numero du groupe, jamais nul
+ *   Flags         : XOR des Flags des paquets du groupe
+ *   payload       : nombre de paquets du groupe (uint16_t), XOR de leurs Length (uint16_t),
+ *                   puis XOR de leurs payloads completes par des zeros jusqu'a la plus longue
+ * Un PTYPE_REPAIR depasse ainsi de REPAIR_HEADER_SIZE octets le plus long paquet de son groupe.
+ */
+#define REPAIR_HEADER_SIZE 4
+/* Taille maximale du payload au format etendu: le paquet tient dans un
+ * datagramme UDP sur IPv6 (65535 octets moins le header UDP) */
+#define EXT_MAX_PAYLOAD_SIZE (65535 - 8 - EXT_HEADER_SIZE - 4)
+/* Payload au format etendu dont le paquet n'est pas plus grand qu'un paquet
+ * DATA plein au format historique: il passe partout ou ce dernier passe */
+#define EXT_SAFE_PAYLOAD_SIZE (DATA_HEADER_SIZE + MAX_PAYLOAD_SIZE - EXT_HEADER_SIZE)
+
+/* Options du payload d'un paquet PTYPE_HELLO, encodees en TLV: type (1 octet),
+ * longueur (1 octet) puis la valeur en network byte-order. Une option inconnue
+ * est ignoree, HELLO_OPT_END termine la liste. */
+typedef enum {
+    HELLO_OPT_END = 0,
+    HELLO_OPT_MAX_PAYLOAD = 1, /* Plus grand payload accepte (uint16_t) */
+    HELLO_OPT_PAYLOAD = 2,     /* Taille des payloads de donnees choisie par le sender (uint16_t) */
+    HELLO_OPT_STRIPE = 3,      /* Bande d'un transfert reparti sur plusieurs flux: identifiant du transfert
+                                * (uint32_t), nombre de bandes (uint16_t), numero de la bande (uint16_t) et
+                                * offset de la bande dans le fichier (uint64_t). Le receiver la renvoie
+                                * telle quelle s'il accepte la bande. */
+    HELLO_OPT_COMPRESS = 4,    /* Compression des payloads proposee par le sender (uint8_t, une valeur de
+                                * compress_t). Le receiver la renvoie s'il sait decompresser. */
+    HELLO_OPT_FEC = 5,         /* Correction d'erreurs proposee par le sender (uint8_t, une valeur de fec_t).
+                                * Le receiver la renvoie s'il sait reconstruire les paquets. */
+} hello_opt_t;
+
+/* Algorithmes de compression des payloads */
+typedef enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_DEFLATE = 1, /* Voir PKT_FLAG_DEFLATE */
+} compress_t;
+
+/* Codes de correction d'erreurs */
+typedef enum {
+    FEC_NONE = 0,
+    FEC_XOR = 1, /* Un paquet de parite par groupe, voir PTYPE_REPAIR */
+} fec_t;
+
+/* Raccourci pour struct hello_opts */
+typedef struct hello_opts hello_opts_t;
+
+/* Valeurs des options, 0 si l'option est absente */
+struct hello_opts {
+	uint16_t max_payload;
+	uint16_t payload;
+	uint32_t stripe_id;
+	uint16_t stripes; /* 0 si le transfert n'est pas reparti */
+	uint16_t stripe;
+	uint64_t stripe_offset;
+	uint8_t compress; /* COMPRESS_NONE si les payloads ne sont pas compresses */
+	uint8_t fec;      /* FEC_NONE sans correction d'erreurs */
+};
+
+/* Taille maximale des options encodees */
+#define HELLO_OPTS_SIZE 34
+
+/* Acquittement selectif: au format etendu, le payload d'un PTYPE_ACK est un
+ * bitmap des paquets deja recus au-dela du Seqnum cumulatif. Le bit de poids
+ * fort de l'octet i/8 indique si le paquet Seqnum + 1 + i est recu. Le bitmap
+ * s'arrete au dernier octet non nul et ne depasse pas SACK_MAX_SIZE octets,
+ * un ACK n'est ainsi jamais plus grand qu'un paquet DATA historique. */
+#define SACK_MAX_SIZE EXT_SAFE_PAYLOAD_SIZE
+
 /* Valeur de retours des fonctions */
 typedef enum {
     PKT_OK = 0,     /* Le paquet a ete traite avec succes */
@@ -94,6 +218,21 @@ void pkt_del(pkt_t*);
  */
 pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt);
 
+/*
+ * Decode des donnees recues sans allocation. Les verifications sont les
+ * memes que celles de pkt_decode, mais le resultat est place dans une
+ * vue fournie par l'appelant dont le payload pointe dans @data.
+ *
+ * @data: L'ensemble d'octets constituant le paquet recu
+ * @len: Le nombre de bytes recus
+ * @view: Une struct pkt_view valide
+ * @post: view decrit le paquet recu et reference @data
+ *
+ * @return: Un code indiquant si l'operation a reussi ou representant
+ *         l'erreur rencontree.
+ */
+pkt_status_code pkt_decode_view(const char *data, const size_t len, pkt_view_t *view);
+
 /*
  * Encode une struct pkt dans un buffer, prÃªt a Ãªtre envoye sur le reseau
  * (c-a-d en network byte-order), incluant le CRC32 du header et
@@ -103,19 +242,40 @@ pkt_status_code pkt_decode(const char *data, const size_t len, pkt_t *pkt);
  * @buf: Le buffer dans lequel la structure sera encodee
  * @len: La taille disponible dans le buffer
  * @len-POST: Le nombre de d'octets ecrit dans le buffer
+ * Si le payload de pkt pointe deja a son offset dans buf, il n'est pas copie.
  * @return: Un code indiquant si l'operation a reussi ou E_NOMEM si
  *         le buffer est trop petit.
  */
 pkt_status_code pkt_encode(const pkt_t*, char *buf, size_t *len);
 
+/*
+ * Encode uniquement le header et son CRC32 dans un buffer, en network
+ * byte-order. Permet d'envoyer un payload qui se trouve ailleurs en memoire
+ * sans le copier, ou de mettre a jour le header d'un paquet deja encode.
+ *
+ * @pkt: La structure dont le header doit etre encode
+ * @buf: Le buffer dans lequel le header sera encode
+ * @len: La taille disponible dans le buffer
+ * @len-POST: Le nombre de d'octets ecrit dans le buffer
+ * @return: Un code indiquant si l'operation a reussi ou E_NOMEM si
+ *         le buffer est trop petit.
+ */
+pkt_status_code pkt_encode_header(const pkt_t*, char *buf, size_t *len);
+
+/*
+ * Encode le CRC32 du payload de pkt (4 octets, network byte-order) dans buf.
+ */
+void pkt_encode_crc2(const pkt_t*, char *buf);
+
 /* Accesseurs pour les champs toujours presents du paquet.
  * Les valeurs renvoyees sont toutes dans l'endianness native
  * de la machine!
  */
 ptypes_t pkt_get_type     (const pkt_t*);
 uint8_t  pkt_get_tr       (const pkt_t*);
-uint8_t  pkt_get_window   (const pkt_t*);
-uint8_t  pkt_get_seqnum   (const pkt_t*);
+uint8_t  pkt_get_ext      (const pkt_t*);
+uint32_t pkt_get_window   (const pkt_t*);
+uint32_t pkt_get_seqnum   (const pkt_t*);
 uint16_t pkt_get_length   (const pkt_t*);
 uint32_t pkt_get_timestamp(const pkt_t*);
 uint32_t pkt_get_crc1     (const pkt_t*);
@@ -135,8 +295,11 @@ uint32_t pkt_get_crc2(const pkt_t*);
  */
 pkt_status_code pkt_set_type     (pkt_t*, const ptypes_t type);
 pkt_status_code pkt_set_tr       (pkt_t*, const uint8_t tr);
-pkt_status_code pkt_set_window   (pkt_t*, const uint8_t window);
-pkt_status_code pkt_set_seqnum   (pkt_t*, const uint8_t seqnum);
+/* Choisit le format du paquet, a appeler avant les autres setters:
+ * Window et Seqnum ne sont limites a 5 et 8 bits que hors format etendu */
+pkt_status_code pkt_set_ext      (pkt_t*, const uint8_t ext);
+pkt_status_code pkt_set_window   (pkt_t*, const uint32_t window);
+pkt_status_code pkt_set_seqnum   (pkt_t*, const uint32_t seqnum);
 pkt_status_code pkt_set_length   (pkt_t*, const uint16_t length);
 pkt_status_code pkt_set_timestamp(pkt_t*, const uint32_t timestamp);
 pkt_status_code pkt_set_crc1     (pkt_t*, const uint32_t crc1);
@@ -160,5 +323,28 @@ pkt_status_code pkt_set_crc2(pkt_t*, const uint32_t crc2);
  */
 ssize_t predict_header_length(const pkt_t *pkt);
 
+/*
+ * Retourne la longueur totale du paquet encode: header, CRC1, payload
+ * et CRC2 s'il est present. Retourne -1 si le paquet n'est pas valide.
+ */
+ssize_t predict_packet_length(const pkt_t *pkt);
+
+/*
+ * Encode les options non nulles de opts dans buf, qui fait au moins HELLO_OPTS_SIZE octets.
+ * @return: Le nombre d'octets ecrits
+ */
+size_t hello_encode_opts(const hello_opts_t *opts, char *buf);
+
+/*
+ * Decode les options d'un payload de PTYPE_HELLO.
+ * @return: PKT_OK, ou E_LENGTH si une option depasse du payload
+ */
+pkt_status_code hello_decode_opts(const char *buf, size_t len, hello_opts_t *opts);
+
+/*
+ * Ajoute length octets de src a la parite dest d'un groupe FEC (XOR), voir PTYPE_REPAIR.
+ */
+void repair_xor(char *dest, const char *src, size_t length);
+
 
 #endif  /* __PACKET_INTERFACE_H_ */
@@ -2,26 +2,153 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <zlib.h>
 
 #include "log.h"
 #include "packet.h"
 #include "socket_helpers.h"
 #include "config.h"
+#include "slot_pool.h"
+#include "output.h"
+#include "crc.h"
+#include "clock.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "event_loop.h"
 
-#define RESP_LEN 10
+/* Largest response: an ACK with a full selective acknowledgement, HELLO options are shorter */
+#define RESP_LEN (EXT_HEADER_SIZE + SACK_MAX_SIZE + 4)
 
-pkt_t *window[N];
-uint8_t window_size = 31; // Logical size
-uint32_t pkt_last_timestamp;
-uint8_t next_seqnum = 0;
-stat_t stats;
+/* File written by the flows of a striped transfer, each one at the offset of its stripe
+ * @addr: host of the sender, each stripe comes from its own port
+ * @id: identifier chosen by the sender
+ * @number: id of the flow that opened the file, which names it
+ * @size: end of the furthest stripe written
+ * @finished: stripes finished or given up, the file is closed once all of them are
+ */
+typedef struct transfer {
+	struct in6_addr addr;
+	uint32_t id;
+	unsigned int number;
+	int fd;
+	uint64_t size;
+	uint16_t stripes;
+	uint16_t finished;
+	struct transfer *next;
+} transfer_t;
+
+/* Parity of the packets of a FEC group received so far, see PTYPE_REPAIR
+ * @id: number of the group, 0 if the entry was never used
+ * @received: packets of the group received so far
+ * @longest: longest payload received, parity holds that many bytes
+ * @length: XOR of the lengths received
+ * @flags: XOR of the flags received
+ * @parity: XOR of the payloads received, payload_size bytes
+ */
+typedef struct fec_group {
+	uint32_t id;
+	uint16_t received;
+	uint16_t longest;
+	uint16_t length;
+	uint8_t flags;
+	char *parity;
+} fec_group_t;
+
+/* State of one transfer, i.e. of the sender at one address.
+ * The original format buffers N packets and counts them modulo MAX_SEQ_SIZE, the extended
+ * format negotiated by the sender buffers EXT_WINDOW_SIZE packets with 32-bit sequence numbers.
+ * @next: next flow of the same bucket of the flow table
+ * @id: order of arrival, names the files of the flow in server mode
+ * @done: the EOT is in sequence, the flow only answers with its last ACK until it expires
+ * @dirty: data was queued on the output during the current batch
+ * @opened: the output is ready, in server mode it is only opened once it is known whether the flow is a stripe
+ * @transfer: striped transfer the flow is a stripe of, NULL if it is not
+ * @base: offset of the data of the flow in the output
+ * @ack_timer: sends the delayed ACK
+ * @idle_timer: forgets the flow once its sender is gone (server mode only), it is armed once and pushed back
+ *              to heard when it fires, rather than on every datagram
+ * @delayed: latest ACK held back, it covers all the in-sequence packets received since the last one sent
+ * @fec: FEC_GROUPS groups indexed by their number, allocated along with their parities by the first protected packet
+ */
+typedef struct flow {
+	struct sockaddr_in6 addr;
+	struct flow *next;
+	unsigned int id;
+	bool done;
+	bool dirty;
+	bool opened;
+	transfer_t *transfer;
+	uint64_t base;
+	tw_timer_t ack_timer;
+	tw_timer_t idle_timer;
+	uint64_t heard; // Time of the last datagram, in us of clock_us()
+	bool extended;
+	uint32_t window_cap;
+	uint32_t seq_mask;
+	uint16_t payload_size; // Size of every payload but the last one, chosen by the sender
+	uint32_t window_size; // Logical size
+	uint32_t pkt_last_timestamp; // Echoed back so that the sender can measure the RTT
+	uint32_t next_seqnum;
+	uint64_t next_index; // Number of packets delivered in sequence, i.e. absolute index of next_seqnum
+	uint32_t sack_last; // Furthest packet received ahead of next_seqnum, stale once next_seqnum passed it
+	uint32_t held; // Packets received ahead of next_seqnum, the ACKs are not delayed while there are any
+	unsigned int unacked; // In-sequence packets received since the last ACK sent
+	char delayed[RESP_LEN];
+	size_t delayed_len;
+	stat_t stats;
+	output_t out;
+	fec_group_t *fec;
+	char *parities;
+	slot_t *window[EXT_WINDOW_SIZE];
+	/* Positional output (-o): payloads are written at their offset on arrival,
+	 * only the sequence numbers received ahead of next_seqnum are remembered */
+	uint64_t received[EXT_WINDOW_SIZE / 64];
+	int64_t eot_seqnum;
+	uint64_t short_index; // First payload shorter than payload_size
+} flow_t;
+
+slot_pool_t pool;
+slot_t *spares[URING_BUFFERS]; // Slots in which the next datagrams are received, BATCH_SIZE of them without io_uring
+char resps[BATCH_SIZE][RESP_LEN]; // Responses of the current batch, queued on acks
+int socket_buffer = SOCKET_BUFFER_SIZE; // Receive buffer granted by the kernel
+unsigned int ack_every = DELAYED_ACK_COUNT;
+send_batch_t acks;
+/* Separate wheels, so that a flow freed when its idle timer fires never has its ACK timer among the expired ones */
+timer_wheel_t ack_timers;
+timer_wheel_t idle_timers;
+
+/* Server mode (-m): the socket stays unconnected and every sender gets its own flow,
+ * written to output_filename and stats_filename suffixed with the id of the flow */
+bool server = false;
+char *output_filename = NULL;
+char *stats_filename = NULL;
+int splice_stdout = 0;
+flow_t *flows[FLOW_BUCKETS];
+unsigned int flow_count = 0; // Flows created so far
+transfer_t *transfers = NULL; // Striped transfers still being written
+z_stream inflater; // Reset for every compressed payload, see PKT_FLAG_DEFLATE
+/* io_uring (-u): the kernel receives the datagrams in the URING_BUFFERS spare slots it was handed,
+ * after a header and their source address, so they start recv_offset bytes into the slots */
+bool use_uring = false;
+uring_t ring;
+struct msghdr recv_msg;
+size_t recv_offset = 0;
 
 int print_usage(char *prog_name) {
-	ERROR("Usage:\n\t%s [-s stats_filename] listen_ip listen_port", prog_name);
+	ERROR("Usage:\n\t%s [-s stats_filename] [-z] [-o output_filename] [-a count] [-m] [-u] listen_ip listen_port", prog_name);
+	ERROR("\t-z: when stdout is a pipe, hand the pages to the reader with vmsplice() instead of copying them");
+	ERROR("\t-o: write the data to a file instead of stdout, each payload at its offset as soon as it arrives");
+	ERROR("\t-a: acknowledge every count packets received in sequence (default %d, 1 acknowledges each one)", DELAYED_ACK_COUNT);
+	ERROR("\t-m: serve any number of senders at once, the data of the n-th one goes to output_filename.n (-o is required).");
+	ERROR("\t    The stripes of a transfer split by the sender over several flows are written to the same file");
+	ERROR("\t-u: receive, acknowledge and write through io_uring, with epoll if the kernel does not support it");
 	return EXIT_FAILURE;
 }
 
-void send_statistics(const char* filename){
+void send_statistics(const char* filename, const stat_t *stats){
 	FILE *fd = filename == NULL ? stderr : fopen(filename, "w");
 	if(fd == NULL) {
 		fprintf(stderr, "Error while opening file.\n");
@@ -29,173 +156,965 @@ void send_statistics(const char* filename){
 		fd = stderr;
 	}
 
-	fprintf(fd, "data_sent,%d\n", stats.data_sent);
-	fprintf(fd, "data_received,%d\n", stats.data_received);
-	fprintf(fd, "data_truncated_received,%d\n", stats.data_truncated_received);
-	fprintf(fd, "ack_sent,%d\n", stats.ack_sent);
-	fprintf(fd, "ack_received,%d\n", stats.ack_received);
-	fprintf(fd, "nack_sent,%d\n", stats.nack_sent);
-	fprintf(fd, "nack_received,%d\n", stats.nack_received);
-	fprintf(fd, "packets_ignored,%d\n", stats.packet_ignored);
-	fprintf(fd, "packets_duplicated,%d\n", stats.packet_duplicated);
+	fprintf(fd, "data_sent,%d\n", stats->data_sent);
+	fprintf(fd, "data_received,%d\n", stats->data_received);
+	fprintf(fd, "data_truncated_received,%d\n", stats->data_truncated_received);
+	fprintf(fd, "ack_sent,%d\n", stats->ack_sent);
+	fprintf(fd, "ack_received,%d\n", stats->ack_received);
+	fprintf(fd, "nack_sent,%d\n", stats->nack_sent);
+	fprintf(fd, "nack_received,%d\n", stats->nack_received);
+	fprintf(fd, "packets_ignored,%d\n", stats->packet_ignored);
+	fprintf(fd, "packets_duplicated,%d\n", stats->packet_duplicated);
+	fprintf(fd, "packets_recovered,%d\n", stats->packets_recovered);
+	fprintf(fd, "syscalls,%lu\n", io_syscalls);
 
 	if(fd != stderr){
 		fclose(fd);
 	}
 }
 
-int check_out_of_sequence(int seqnum){
-	uint8_t min = next_seqnum;
-	uint8_t max = (next_seqnum+WINDOW_MAX_SIZE) % MAX_SEQ_SIZE;
-	if(max < min){
-		if(seqnum < min && seqnum >= max){
-			ERROR("Unexpected seqnum\n");
-			stats.packet_ignored += 1;
-			return 1;
+/* Largest window that fits in the buffers, EXT_BUFFER_SIZE bytes at most. A whole window
+ * may arrive at once: it must also fit in the socket receive buffer */
+uint32_t max_window(const flow_t *flow){
+	uint32_t window = EXT_BUFFER_SIZE / flow->payload_size;
+	uint32_t burst = socket_buffer / (flow->payload_size + EXT_FRAME_OVERHEAD);
+	if(burst < window) window = burst;
+	return window < flow->window_cap - 1 ? window : flow->window_cap - 1;
+}
+
+/* Switch between the original and the extended format, before any data is received */
+void set_extended(flow_t *flow, bool ext){
+	flow->extended = ext;
+	flow->window_cap = ext ? EXT_WINDOW_SIZE : N;
+	flow->seq_mask = ext ? UINT32_MAX : MAX_SEQ_SIZE - 1;
+	flow->payload_size = MAX_PAYLOAD_SIZE;
+	flow->window_size = max_window(flow);
+}
+
+static inline uint32_t window_idx(const flow_t *flow, uint32_t seqnum){
+	return seqnum & (flow->window_cap - 1);
+}
+
+/* Only the window_cap - 1 sequence numbers from next_seqnum can be buffered */
+int check_out_of_sequence(flow_t *flow, uint32_t seqnum){
+	if(((seqnum - flow->next_seqnum) & flow->seq_mask) >= flow->window_cap - 1){
+		ERROR("Unexpected seqnum\n");
+		flow->stats.packet_ignored += 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* Queue the payloads of all the buffered packets following next_seqnum for output
+ * @return: 0 if the EOT packet was among them, 1 otherwise
+ */
+int flush_window(flow_t *flow){
+	int ret = 1;
+	/* Iterate over the buffer until there is no more packets, i.d. next_seqnum hasn't arrived yet */
+	uint32_t idx = window_idx(flow, flow->next_seqnum);
+	while(flow->window[idx] != NULL){
+		/* End of data transmission if packet delayed*/
+		pkt_t *pkt = &flow->window[idx]->pkt;
+		if(!pkt_get_length(pkt)){
+			DEBUG("EOT received\n");
+			ret = 0;
+		}
+		/* The slot goes back to the pool once the payload is written */
+		if(output_push(&flow->out, pkt_get_payload(pkt), pkt_get_length(pkt), flow->window[idx])){
+			ERROR("Error while writing packet to stdout\n");
+		}
+		flow->window[idx] = NULL;
+		flow->window_size++;
+		flow->held--;
+		flow->next_seqnum = (flow->next_seqnum + 1) & flow->seq_mask;
+		flow->next_index++;
+
+		idx = window_idx(flow, flow->next_seqnum);
+	}
+	return ret;
+}
+
+static inline bool received_test(const flow_t *flow, uint32_t seqnum){
+	uint32_t idx = window_idx(flow, seqnum);
+	return flow->received[idx / 64] >> (idx % 64) & 1;
+}
+
+static inline void received_set(flow_t *flow, uint32_t seqnum, bool value){
+	uint32_t idx = window_idx(flow, seqnum);
+	if(value) flow->received[idx / 64] |= (uint64_t) 1 << (idx % 64);
+	else flow->received[idx / 64] &= ~((uint64_t) 1 << (idx % 64));
+}
+
+/* Whether a packet ahead of next_seqnum was already received */
+static inline bool is_held(const flow_t *flow, uint32_t seqnum){
+	return flow->out.positional ? received_test(flow, seqnum) : flow->window[window_idx(flow, seqnum)] != NULL;
+}
+
+/* Remember how far the packets received out of order go, the selective acknowledgement stops there */
+static inline void sack_extend(flow_t *flow, uint32_t seqnum){
+	uint32_t ahead = (flow->sack_last - flow->next_seqnum) & flow->seq_mask;
+	if(ahead >= flow->window_cap || ((seqnum - flow->next_seqnum) & flow->seq_mask) > ahead){
+		flow->sack_last = seqnum;
+	}
+}
+
+/* Build the bitmap of the packets held beyond next_seqnum, see SACK_MAX_SIZE
+ * @sack: buffer of SACK_MAX_SIZE bytes
+ * @return: the length of the bitmap, 0 if nothing is held or in the original format
+ */
+size_t encode_sack(const flow_t *flow, char* sack){
+	uint32_t ahead = (flow->sack_last - flow->next_seqnum) & flow->seq_mask;
+	if(!flow->extended || ahead >= flow->window_cap){
+		return 0;
+	}
+	if(ahead > 8 * SACK_MAX_SIZE){
+		ahead = 8 * SACK_MAX_SIZE;
+	}
+	size_t len = (ahead + 7) / 8;
+	memset(sack, 0, len);
+	for(uint32_t i=0; i<ahead; i++){
+		uint32_t seqnum = (flow->next_seqnum + 1 + i) & flow->seq_mask;
+		if(is_held(flow, seqnum)){
+			sack[i / 8] |= 0x80 >> (i % 8);
+		}
+	}
+	while(len && !sack[len - 1]) len--;
+	return len;
+}
+
+/* Write a payload at its offset in the output file, then move next_seqnum
+ * past all the packets received in sequence.
+ * Offsets assume that only the last payload of the transfer is shorter than payload_size.
+ * @return: 0 if the EOT packet is now in sequence, 1 otherwise
+ */
+int deliver_positional(flow_t *flow, const pkt_view_t *pkt){
+	uint64_t index = flow->next_index + ((pkt->seqnum - flow->next_seqnum) & flow->seq_mask);
+	bool in_order = pkt->seqnum == flow->next_seqnum;
+	if(pkt->length){
+		if(index > flow->short_index){
+			ERROR("Payload %lu follows a short one, the output file is corrupted\n", (unsigned long) index);
 		}
-	}else{
-		if(seqnum < min || seqnum >= max){
-			ERROR("Unexpected seqnum\n");
-			stats.packet_ignored += 1;
-			return 1;
+		if(pkt->length < flow->payload_size && index < flow->short_index){
+			flow->short_index = index;
 		}
+		if(output_push_at(&flow->out, pkt->payload, pkt->length, flow->base + index * flow->payload_size)){
+			ERROR("Error while writing packet to the output file\n");
+		}
+	} else {
+		flow->eot_seqnum = pkt->seqnum;
+	}
+	received_set(flow, pkt->seqnum, true);
+	if(!in_order) flow->held++;
+
+	int ret = 1;
+	while(received_test(flow, flow->next_seqnum)){
+		received_set(flow, flow->next_seqnum, false);
+		if(!in_order) flow->held--;
+		in_order = false;
+		if(flow->next_seqnum == flow->eot_seqnum){
+			DEBUG("EOT received\n");
+			ret = 0;
+		}
+		flow->next_seqnum = (flow->next_seqnum + 1) & flow->seq_mask;
+		flow->next_index++;
+	}
+	return ret;
+}
+
+/* Inflate a compressed payload (PKT_FLAG_DEFLATE) into a fresh slot, which replaces the one it was received in
+ * @pkt: set to describe the inflated payload
+ * @return: 0 in case of success, -1 if the payload does not inflate to at most payload_size bytes
+ */
+int inflate_payload(const flow_t *flow, slot_t **slot, pkt_view_t *pkt){
+	slot_t *plain = slot_get(&pool);
+	inflateReset(&inflater);
+	inflater.next_in = (Bytef*) pkt->payload;
+	inflater.avail_in = pkt->length;
+	inflater.next_out = (Bytef*) plain->data;
+	inflater.avail_out = flow->payload_size;
+	if(inflate(&inflater, Z_FINISH) != Z_STREAM_END || !inflater.total_out){
+		slot_put(&pool, plain);
+		return -1;
 	}
+	slot_put(&pool, *slot);
+	*slot = plain;
+	pkt->payload = plain->data;
+	pkt->length = inflater.total_out;
 	return 0;
 }
 
-/* Handle a packet
- * @return: 0 when all data has been received, 1 when a packet can be send back, 2 when the packet had to be ignored
+/* Add a data packet received for the first time to the parity of its FEC group. The group takes the
+ * entry of an older one, whose packets can then no longer be rebuilt
  */
-int handle_packet(char* buffer, int length){
-	/* Initialisation of received packet */
-	pkt_t* recv_pkt = pkt_new();
+void fec_add(flow_t *flow, const pkt_view_t *pkt){
+	if(flow->fec == NULL){
+		flow->fec = calloc(FEC_GROUPS, sizeof(fec_group_t));
+		flow->parities = malloc((size_t) FEC_GROUPS * flow->payload_size);
+		if(flow->fec == NULL || flow->parities == NULL){
+			ERROR("Could not allocate the FEC groups\n");
+			free(flow->fec);
+			free(flow->parities);
+			flow->fec = NULL;
+			flow->parities = NULL;
+			return;
+		}
+		for(int i=0; i<FEC_GROUPS; i++){
+			flow->fec[i].parity = flow->parities + (size_t) i * flow->payload_size;
+		}
+	}
+	fec_group_t *group = &flow->fec[pkt->window % FEC_GROUPS];
+	if(group->id != pkt->window){
+		if(group->id && (int32_t) (group->id - pkt->window) > 0){
+			return;
+		}
+		group->id = pkt->window;
+		group->received = 0;
+		group->longest = 0;
+		group->length = 0;
+		group->flags = 0;
+	}
+	if(pkt->length > flow->payload_size){
+		return;
+	}
+	repair_xor(group->parity, pkt->payload, pkt->length < group->longest ? pkt->length : group->longest);
+	if(pkt->length > group->longest){
+		memcpy(group->parity + group->longest, pkt->payload + group->longest, pkt->length - group->longest);
+		group->longest = pkt->length;
+	}
+	group->length ^= pkt->length;
+	group->flags ^= pkt->flags;
+	group->received++;
+}
+
+/* Rebuild in place the only packet of its group that was neither received nor delivered from a repair packet
+ * @pkt: the repair packet, turned into the data packet rebuilt, whose payload lives in the same slot
+ * @return: 0 if a packet was rebuilt, -1 if none is missing or more than one is
+ */
+int fec_repair(flow_t *flow, pkt_view_t *pkt){
+	if(flow->fec == NULL || pkt->length < REPAIR_HEADER_SIZE){
+		return -1;
+	}
+	uint16_t count, length;
+	memcpy(&count, pkt->payload, 2);
+	memcpy(&length, pkt->payload + 2, 2);
+	count = ntohs(count);
+	fec_group_t *group = &flow->fec[pkt->window % FEC_GROUPS];
+	if(group->id != pkt->window || group->received + 1 != count){
+		return -1;
+	}
+	length = ntohs(length) ^ group->length;
+	if(length > pkt->length - REPAIR_HEADER_SIZE || length > flow->payload_size || !length){
+		return -1;
+	}
+	/* The missing packet is the one of the group still ahead of next_seqnum and not held */
+	uint32_t missing = pkt->seqnum;
+	uint32_t i = 0;
+	for(; i<count; i++, missing = (missing + 1) & flow->seq_mask){
+		uint32_t ahead = (missing - flow->next_seqnum) & flow->seq_mask;
+		if(ahead < flow->window_cap - 1 && !is_held(flow, missing)) break;
+	}
+	if(i == count){
+		return -1;
+	}
+	char *payload = (char*) pkt->payload + REPAIR_HEADER_SIZE;
+	repair_xor(payload, group->parity, length < group->longest ? length : group->longest);
+	group->received = count;
+	pkt->type = PTYPE_DATA;
+	pkt->seqnum = missing;
+	pkt->length = length;
+	pkt->flags ^= group->flags;
+	pkt->payload = payload;
+	flow->stats.packets_recovered += 1;
+	DEBUG("Seqnum %u rebuilt from its FEC group\n", missing);
+	return 0;
+}
+
+/* Prepare the payload of a data packet received for the first time: it joins the parity of its FEC group
+ * as it was sent, unless it was rebuilt from it, then it is inflated
+ * @return: 0 in case of success, -1 if the payload could not be inflated
+ */
+int accept_payload(flow_t *flow, slot_t **slot, pkt_view_t *pkt, bool rebuilt){
+	if((pkt->flags & PKT_FLAG_FEC) && !rebuilt){
+		fec_add(flow, pkt);
+	}
+	if((pkt->flags & PKT_FLAG_DEFLATE) && inflate_payload(flow, slot, pkt)){
+		return -1;
+	}
+	return 0;
+}
+
+/* Open the file of a flow in server mode, named after its id
+ * @return: 0 in case of success, -1 otherwise
+ */
+int flow_open_output(flow_t *flow){
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.%u", output_filename, flow->id);
+	if(output_open_file(&flow->out, path)){
+		return -1;
+	}
+	flow->out.pool = &pool;
+	flow->out.ring = use_uring ? &ring : NULL;
+	flow->opened = true;
+	return 0;
+}
+
+/* Make a flow the stripe of a transfer, whose file is opened by its first stripe
+ * @return: 0 in case of success, -1 otherwise
+ */
+int flow_join(flow_t *flow, const hello_opts_t *stripe){
+	transfer_t *transfer = transfers;
+	while(transfer != NULL && (transfer->id != stripe->stripe_id ||
+	      memcmp(&transfer->addr, &flow->addr.sin6_addr, sizeof(transfer->addr)))){
+		transfer = transfer->next;
+	}
+	if(transfer == NULL){
+		transfer = calloc(1, sizeof(transfer_t));
+		if(transfer == NULL){
+			ERROR("Could not allocate a transfer\n");
+			return -1;
+		}
+		char path[4096];
+		snprintf(path, sizeof(path), "%s.%u", output_filename, flow->id);
+		transfer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(transfer->fd == -1){
+			ERROR("Could not open %s\n", path);
+			free(transfer);
+			return -1;
+		}
+		transfer->addr = flow->addr.sin6_addr;
+		transfer->id = stripe->stripe_id;
+		transfer->number = flow->id;
+		transfer->stripes = stripe->stripes;
+		transfer->next = transfers;
+		transfers = transfer;
+		DEBUG("Striped transfer %u over %u flows\n", transfer->number, transfer->stripes);
+	}
+	output_open_shared(&flow->out, transfer->fd, stripe->stripe_offset);
+	flow->out.pool = &pool;
+	flow->out.ring = use_uring ? &ring : NULL;
+	flow->transfer = transfer;
+	flow->base = stripe->stripe_offset;
+	flow->opened = true;
+	return 0;
+}
+
+/* Close the file of a transfer, cut at the end of its furthest stripe */
+void transfer_close(transfer_t *transfer){
+	transfer_t **link = &transfers;
+	while(*link != transfer){
+		link = &(*link)->next;
+	}
+	*link = transfer->next;
+	if(ftruncate(transfer->fd, transfer->size) == -1){
+		ERROR("Could not truncate the output of transfer %u\n", transfer->number);
+	}
+	close(transfer->fd);
+	free(transfer);
+}
+
+/* Handle a packet received in a spare slot
+ * @slot: the slot holding the packet, set to a fresh slot if the packet had to be buffered
+ * @length: the number of bytes received
+ * @resp: buffer of RESP_LEN bytes in which the response is encoded
+ * @resp_len: set to the length of the response
+ * @return: 0 when all data has been received, 1 when a packet can be send back, 2 when the packet had to be ignored,
+ *          3 when the response is an ACK of in-sequence data that may be delayed
+ */
+int handle_packet(flow_t *flow, slot_t** slot, int length, char* resp, size_t* resp_len){
+	/* The received packet is decoded in place, its payload still lives in the slot */
+	pkt_view_t recv_pkt;
 	int ret = 1;
 
 	/* If there was any errors during packet decoding, ignore it */
-	if(pkt_decode(buffer, length, recv_pkt)){
+	if(pkt_decode_view((*slot)->data + recv_offset, length, &recv_pkt)){
 	  ERROR("Could not decode packet\n");
-	  pkt_del(recv_pkt);
   	  return 2;
 	}
 
-	DEBUG("recv_pkt->length %d\n", recv_pkt->length);
-	
-	uint8_t recv_seqnum = pkt_get_seqnum(recv_pkt);
-	pkt_last_timestamp = pkt_get_timestamp(recv_pkt);
-	
-	DEBUG("recv_seqnum = %d\n", recv_seqnum);
+	DEBUG("recv_pkt.length %d\n", recv_pkt.length);
+
+	uint32_t recv_seqnum = recv_pkt.seqnum;
+	flow->pkt_last_timestamp = recv_pkt.timestamp;
+
+	DEBUG("recv_seqnum = %u\n", recv_seqnum);
+
+	/* The format can only change as long as no data arrived: the sender offers the extended
+	 * one with a HELLO, or gave up on it when all our HELLO got lost */
+	bool started = flow->stats.data_received || flow->stats.data_truncated_received;
+	if(recv_pkt.type == PTYPE_HELLO && !flow->extended){
+		if(started){
+			flow->stats.packet_ignored += 1;
+			return 2;
+		}
+		DEBUG("Switching to the extended format\n");
+		set_extended(flow, true);
+	} else if(recv_pkt.ext != flow->extended){
+		if(started){
+			flow->stats.packet_ignored += 1;
+			return 2;
+		}
+		set_extended(flow, recv_pkt.ext);
+	}
+
+	/* A repair packet that rebuilds a lost packet is then handled as that packet */
+	bool rebuilt = false;
+	if(recv_pkt.type == PTYPE_REPAIR){
+		if(recv_pkt.tr || fec_repair(flow, &recv_pkt)){
+			return 2;
+		}
+		rebuilt = true;
+	}
+
+	/* The first data packet of a flow that is not a stripe gets it its own file */
+	if(recv_pkt.type == PTYPE_DATA && !flow->opened && flow_open_output(flow)){
+		flow->stats.packet_ignored += 1;
+		return 2;
+	}
 
 	/* End of data transmission */
-	if(!pkt_get_length(recv_pkt) && (recv_seqnum == next_seqnum)){
+	if(recv_pkt.type == PTYPE_DATA && !recv_pkt.tr && !recv_pkt.length && (recv_seqnum == flow->next_seqnum)){
 		DEBUG("EOT received\n");
 		ret = 0;
 	}
-	
-	/* Response packet to send back */
-	pkt_t* resp_pkt = pkt_new();
 
-	/* Send NACK */
-	if(pkt_get_tr(recv_pkt)) {
-		stats.data_truncated_received += 1;
-		stats.nack_sent += 1;
+	/* Response packet to send back, its payload (HELLO options or SACK bitmap) is encoded along with it */
+	pkt_t resp_pkt;
+	memset(&resp_pkt, 0, sizeof(pkt_t));
+	pkt_set_ext(&resp_pkt, flow->extended);
+
+	char opts[HELLO_OPTS_SIZE];
+	static char sack[SACK_MAX_SIZE];
+	if(recv_pkt.type == PTYPE_HELLO){
+		/* Accept the extended format and the payload size chosen by the sender,
+		 * the window is the one of the data to come */
+		hello_opts_t offer, answer = {.max_payload = EXT_MAX_PAYLOAD_SIZE};
+		if(hello_decode_opts(recv_pkt.payload, recv_pkt.length, &offer)){
+			flow->stats.packet_ignored += 1;
+			return 2;
+		}
+		/* A sender that negotiates the payload size uses EXT_SAFE_PAYLOAD_SIZE until both agreed on another one */
+		if((offer.payload || offer.max_payload) && !started){
+			flow->payload_size = offer.payload ? offer.payload : EXT_SAFE_PAYLOAD_SIZE;
+			flow->window_size = max_window(flow);
+		}
+		answer.payload = flow->payload_size;
+		if(offer.compress == COMPRESS_DEFLATE){
+			answer.compress = COMPRESS_DEFLATE;
+		}
+		if(offer.fec == FEC_XOR){
+			answer.fec = FEC_XOR;
+		}
+		/* A stripe is accepted, and its option echoed, only in server mode where all the flows are served */
+		if(offer.stripes && server && !started && (flow->transfer != NULL || (!flow->opened && !flow_join(flow, &offer)))){
+			answer.stripe_id = offer.stripe_id;
+			answer.stripes = offer.stripes;
+			answer.stripe = offer.stripe;
+			answer.stripe_offset = offer.stripe_offset;
+		}
+		pkt_set_type(&resp_pkt, PTYPE_HELLO);
+		pkt_set_seqnum(&resp_pkt, flow->next_seqnum);
+		pkt_set_length(&resp_pkt, hello_encode_opts(&answer, opts));
+		resp_pkt.payload = opts;
+	} else if(recv_pkt.type == PTYPE_PROBE){
+		/* Path MTU probe, its size is echoed in the seqnum */
+		pkt_set_type(&resp_pkt, PTYPE_PROBE);
+		pkt_set_seqnum(&resp_pkt, recv_seqnum);
+	} else if(recv_pkt.type != PTYPE_DATA){
+		flow->stats.packet_ignored += 1;
+		return 2;
+	} else if(recv_pkt.tr) {
+		/* Send NACK */
+		flow->stats.data_truncated_received += 1;
+		flow->stats.nack_sent += 1;
 
 		DEBUG("Starting NACK\n");
-		pkt_set_type(resp_pkt, 3);
-		pkt_set_seqnum(resp_pkt, recv_seqnum);
+		pkt_set_type(&resp_pkt, PTYPE_NACK);
+		pkt_set_seqnum(&resp_pkt, recv_seqnum);
 	} else {
-		stats.data_received += 1;
-		stats.ack_sent += 1;
+		flow->stats.data_received += 1;
 
 		DEBUG("Starting ACK\n");
-		pkt_set_type(resp_pkt, 2);
-
-		/* Add the packet to the buffer */
-		if(window[recv_seqnum % N] == NULL){
-			if(!check_out_of_sequence(recv_seqnum)){
-				window[recv_seqnum % N] = recv_pkt;
-				window_size--;
-			
-				/* Iterate over the buffer until there is no more packets, i.d. next_seqnum hasn't arrived yet */
-				uint8_t idx = next_seqnum % N;
-				int n_wri;
-				DEBUG("Before next_seqnum = %d\n", next_seqnum);
-				while(window[idx] != NULL){
-					/* End of data transmission if packet delayed*/
-					if(!pkt_get_length(window[idx])){
-						DEBUG("EOT received\n");
-						ret = 0;
-					}
-					n_wri = write(1, window[idx]->payload, pkt_get_length(window[idx]));
-					if(n_wri == -1) ERROR("Error while writing packet to stdout\n");
-					pkt_del(window[idx]);
-					window[idx] = NULL;
-					window_size++;
-					next_seqnum = (next_seqnum + 1) % MAX_SEQ_SIZE;
-					
-					idx = (idx + 1) % N;
+		pkt_set_type(&resp_pkt, PTYPE_ACK);
+		/* Only the ACKs of packets arriving in sequence, with no hole behind them, may wait */
+		bool in_order = recv_seqnum == flow->next_seqnum;
+
+		if(flow->window[window_idx(flow, recv_seqnum)] != NULL || (flow->out.positional && received_test(flow, recv_seqnum))){
+			flow->stats.packet_duplicated += 1;
+		} else if(check_out_of_sequence(flow, recv_seqnum)){
+			in_order = false;
+		} else if(accept_payload(flow, slot, &recv_pkt, rebuilt)){
+			ERROR("Could not inflate packet %u\n", recv_seqnum);
+			flow->stats.packet_ignored += 1;
+			in_order = false;
+		} else {
+			DEBUG("Before next_seqnum = %d\n", flow->next_seqnum);
+			if(recv_seqnum != flow->next_seqnum){
+				sack_extend(flow, recv_seqnum);
+			}
+			if(flow->out.positional){
+				/* Nothing is buffered, the payload is written where it belongs */
+				if(!deliver_positional(flow, &recv_pkt)) ret = 0;
+			} else if(recv_seqnum == flow->next_seqnum){
+				/* In-order packet: deliver it straight from the receive buffer. When splicing,
+				 * the pipe keeps referencing the slot so another one is needed to receive in */
+				slot_t *owned = NULL;
+				if(flow->out.splice){
+					owned = *slot;
+					*slot = slot_get(&pool);
 				}
-				DEBUG("After next_seqnum = %d\n", next_seqnum);
+				if(output_push(&flow->out, recv_pkt.payload, recv_pkt.length, owned)){
+					ERROR("Error while writing packet to stdout\n");
+				}
+				flow->next_seqnum = (flow->next_seqnum + 1) & flow->seq_mask;
+				flow->next_index++;
+				if(!flush_window(flow)) ret = 0;
+			} else {
+				/* Out-of-order packet: the slot becomes part of the window */
+				slot_t *spare = *slot;
+				pkt_set_ext(&spare->pkt, flow->extended);
+				pkt_set_seqnum(&spare->pkt, recv_seqnum);
+				pkt_set_length(&spare->pkt, recv_pkt.length);
+				spare->pkt.payload = (char*) recv_pkt.payload;
+				flow->window[window_idx(flow, recv_seqnum)] = spare;
+				*slot = slot_get(&pool);
+				flow->window_size--;
+				flow->held++;
 			}
-		}else{
-			stats.packet_duplicated += 1;
+			DEBUG("After next_seqnum = %d\n", flow->next_seqnum);
+		}
+		pkt_set_seqnum(&resp_pkt, flow->next_seqnum);
+		/* The sender only retransmits the holes */
+		pkt_set_length(&resp_pkt, encode_sack(flow, sack));
+		resp_pkt.payload = sack;
+		if(ret && in_order && !flow->held){
+			ret = 3;
+		} else {
+			/* This ACK is cumulative, it also covers the delayed one */
+			flow->stats.ack_sent += 1;
+			flow->unacked = 0;
+			tw_cancel(&ack_timers, &flow->ack_timer);
 		}
-		pkt_set_seqnum(resp_pkt, next_seqnum);
 	}
 
-	size_t enco_len = RESP_LEN;
-	pkt_set_window(resp_pkt, window_size);
-	pkt_set_timestamp(resp_pkt, pkt_last_timestamp);
-	pkt_encode(resp_pkt, buffer, &enco_len);
-	
-	DEBUG("pkt->seqnum = %d\n", resp_pkt->seqnum);
+	*resp_len = RESP_LEN;
+	pkt_set_window(&resp_pkt, flow->window_size);
+	pkt_set_timestamp(&resp_pkt, flow->pkt_last_timestamp);
+	pkt_encode(&resp_pkt, resp, resp_len);
 
-	pkt_del(resp_pkt);
+	DEBUG("resp_pkt.seqnum = %u\n", resp_pkt.seqnum);
 
 	return ret;
 }
 
+static inline unsigned int flow_bucket(const struct sockaddr_in6 *addr){
+	/* FNV-1a over the address and the port */
+	uint32_t hash = 2166136261u;
+	const uint8_t *bytes = addr->sin6_addr.s6_addr;
+	for(size_t i=0; i<sizeof(addr->sin6_addr.s6_addr); i++){
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	hash = (hash ^ (addr->sin6_port & 0xff)) * 16777619u;
+	hash = (hash ^ (addr->sin6_port >> 8)) * 16777619u;
+	return hash % FLOW_BUCKETS;
+}
+
+/* @return: the flow of the sender at addr, NULL if there is none */
+flow_t* flow_find(const struct sockaddr_in6 *addr){
+	flow_t *flow = flows[flow_bucket(addr)];
+	while(flow != NULL && (flow->addr.sin6_port != addr->sin6_port ||
+	      memcmp(&flow->addr.sin6_addr, &addr->sin6_addr, sizeof(addr->sin6_addr)))){
+		flow = flow->next;
+	}
+	return flow;
+}
+
+/* Start the flow of a new sender, its output is stdout or output_filename. In server mode, it is opened
+ * by the first data packet, or joined by the HELLO of a stripe
+ * @return: NULL if the output could not be opened
+ */
+flow_t* flow_new(const struct sockaddr_in6 *addr){
+	/* The window is never touched with a positional output, its pages are not either */
+	flow_t *flow = calloc(1, sizeof(flow_t));
+	if(flow == NULL){
+		ERROR("Could not allocate a flow\n");
+		return NULL;
+	}
+	if(!server){
+		if(output_filename != NULL ? output_open_file(&flow->out, output_filename) : output_open(&flow->out, 1, splice_stdout)){
+			free(flow);
+			return NULL;
+		}
+		flow->out.pool = &pool;
+		flow->out.ring = use_uring ? &ring : NULL;
+		flow->opened = true;
+	}
+	flow->addr = *addr;
+	flow->id = flow_count++;
+	flow->window_cap = N;
+	flow->seq_mask = MAX_SEQ_SIZE - 1;
+	flow->payload_size = MAX_PAYLOAD_SIZE;
+	flow->window_size = WINDOW_MAX_SIZE;
+	flow->eot_seqnum = -1;
+	flow->short_index = UINT64_MAX;
+	tw_timer_init(&flow->ack_timer);
+	tw_timer_init(&flow->idle_timer);
+
+	unsigned int bucket = flow_bucket(addr);
+	flow->next = flows[bucket];
+	flows[bucket] = flow;
+	return flow;
+}
+
+/* Write the statistics of a flow, its data and close its output */
+void flow_finish(flow_t *flow){
+	if(output_flush(&flow->out)){
+		ERROR("Error while writing to stdout\n");
+	}
+	if(server && stats_filename != NULL){
+		char path[4096];
+		snprintf(path, sizeof(path), "%s.%u", stats_filename, flow->id);
+		send_statistics(path, &flow->stats);
+	} else {
+		send_statistics(stats_filename, &flow->stats);
+	}
+	output_close(&flow->out);
+	transfer_t *transfer = flow->transfer;
+	if(transfer != NULL){
+		if(flow->out.size > transfer->size) transfer->size = flow->out.size;
+		if(++transfer->finished == transfer->stripes) transfer_close(transfer);
+		flow->transfer = NULL;
+	}
+}
+
+/* Forget a flow, it must be finished */
+void flow_free(flow_t *flow){
+	flow_t **link = &flows[flow_bucket(&flow->addr)];
+	while(*link != flow){
+		link = &(*link)->next;
+	}
+	*link = flow->next;
+	tw_cancel(&ack_timers, &flow->ack_timer);
+	tw_cancel(&idle_timers, &flow->idle_timer);
+	for(uint32_t i=0; i<flow->window_cap; i++){
+		if(flow->window[i] != NULL) slot_put(&pool, flow->window[i]);
+	}
+	free(flow->fec);
+	free(flow->parities);
+	free(flow);
+}
+
+/* Timer callback: send the delayed ACK of a flow */
+void ack_expired(tw_timer_t *timer, void *arg){
+	int sfd = *(int*) arg;
+	flow_t *flow = TW_ENTRY(timer, flow_t, ack_timer);
+	if(flow->unacked){
+		send_batch_queue_to(sfd, &acks, flow->delayed, flow->delayed_len, &flow->addr);
+		flow->stats.ack_sent += 1;
+		flow->unacked = 0;
+	}
+}
+
+/* Timer callback: forget a flow whose sender went silent, or that finished a while ago */
+void flow_expired(tw_timer_t *timer, void *arg){
+	(void) arg;
+	flow_t *flow = TW_ENTRY(timer, flow_t, idle_timer);
+	uint64_t deadline = flow->heard + (flow->done ? FLOW_LINGER : FLOW_TIMEOUT);
+	if(deadline > clock_us()){
+		/* The sender was heard since the timer was armed */
+		tw_schedule(&idle_timers, timer, deadline);
+		return;
+	}
+	if(!flow->done){
+		ERROR("Sender %u went silent, dropping its transfer\n", flow->id);
+		flow_finish(flow);
+	}
+	flow_free(flow);
+}
+
+/* Handle a datagram received from src in a spare slot, its response is queued on acks
+ * @slot: the spare slot, replaced if the packet had to be kept
+ * @dirty: flows whose output has to be flushed after the batch, a flow is added to the n_dirty ones once
+ * @return: false once the transfer is over, outside of server mode
+ */
+bool receive_datagram(const int sfd, slot_t **slot, int length, const struct sockaddr_in6 *src, flow_t **dirty, int *n_dirty){
+	flow_t *flow = flow_find(src);
+	if(flow == NULL){
+		/* Only a valid HELLO or DATA packet opens a flow, in server mode */
+		pkt_view_t first;
+		if(!server || pkt_decode_view((*slot)->data + recv_offset, length, &first) ||
+		   (first.type != PTYPE_HELLO && first.type != PTYPE_DATA) ||
+		   (flow = flow_new(src)) == NULL){
+			return true;
+		}
+		DEBUG("New sender %u\n", flow->id);
+	}
+	if(server){
+		flow->heard = clock_us();
+		if(!tw_is_armed(&flow->idle_timer)) tw_schedule(&idle_timers, &flow->idle_timer, flow->heard + FLOW_TIMEOUT);
+	}
+	if(flow->done){
+		/* The last ACK got lost, the sender retransmits its EOT */
+		send_batch_queue_to(sfd, &acks, flow->delayed, flow->delayed_len, &flow->addr);
+		return true;
+	}
+	DEBUG("STARTING handle_packet()\n");
+	size_t resp_len;
+	int ret = handle_packet(flow, slot, length, resps[acks.count], &resp_len);
+	DEBUG("handle_packet() returned %d\n", ret);
+	if(ret!=2 && !flow->dirty){
+		flow->dirty = true;
+		dirty[(*n_dirty)++] = flow;
+	}
+	if(ret==3){
+		if(++flow->unacked < ack_every){
+			memcpy(flow->delayed, resps[acks.count], resp_len);
+			flow->delayed_len = resp_len;
+			if(flow->unacked == 1) tw_schedule(&ack_timers, &flow->ack_timer, clock_us() + DELAYED_ACK_TIMEOUT);
+			return true;
+		}
+		flow->stats.ack_sent += 1;
+		flow->unacked = 0;
+		tw_cancel(&ack_timers, &flow->ack_timer);
+	}
+	if(ret==0){
+		/* The final ACK is kept to answer the retransmissions of the EOT */
+		flow->done = true;
+		memcpy(flow->delayed, resps[acks.count], resp_len);
+		flow->delayed_len = resp_len;
+		/* Lingering is shorter than the idle timeout the timer was armed for */
+		if(server) tw_schedule(&idle_timers, &flow->idle_timer, flow->heard + FLOW_LINGER);
+	}
+	if(ret!=2){
+		send_batch_queue_to(sfd, &acks, resps[acks.count], resp_len, &flow->addr);
+	}
+	return ret!=0 || server;
+}
+
+/* Send the responses queued on acks, through the ring with io_uring */
+static void send_acks(const int sfd){
+	DEBUG("Writing %u responses to socket\n", acks.count);
+	if(use_uring){
+		uring_send_batch(&ring, sfd, &acks);
+	} else {
+		send_batch_flush(sfd, &acks);
+	}
+}
+
+/* Send the responses of a batch, then write the data newly in sequence once the sender got its ACKs */
+void end_batch(const int sfd, flow_t **dirty, int n_dirty){
+	send_acks(sfd);
+	for(int i=0; i<n_dirty; i++){
+		flow_t *flow = dirty[i];
+		flow->dirty = false;
+		if(flow->done){
+			flow_finish(flow);
+		} else if(output_flush(&flow->out)){
+			ERROR("Error while writing to stdout\n");
+		}
+	}
+	fflush(NULL);
+}
+
+/* Fire the delayed ACKs and the idle flows that are due */
+void expire_timers(const int sfd){
+	int fd = sfd;
+	uint64_t now = clock_us();
+	tw_advance(&ack_timers, now, ack_expired, &fd);
+	send_acks(sfd);
+	tw_advance(&idle_timers, now, flow_expired, NULL);
+}
+
+/* @return: the time at which a delayed ACK is due or a flow expires, UINT64_MAX if none is pending.
+ * It does not depend on the number of flows, see tw_next_expiry() */
+uint64_t timers_deadline(){
+	uint64_t deadline = tw_next_expiry(&ack_timers);
+	uint64_t idle = server ? tw_next_expiry(&idle_timers) : UINT64_MAX;
+	return idle < deadline ? idle : deadline;
+}
+
+/* @return: the delay in microseconds until timers_deadline(), -1 if none is pending */
+int64_t timers_timeout(){
+	uint64_t deadline = timers_deadline();
+	if(deadline == UINT64_MAX) return -1;
+	uint64_t now = clock_us();
+	return now < deadline ? (int64_t) (deadline - now) : 0;
+}
+
+/* Every datagram of a batch may need a fresh slot. Only stdout may splice, in which case there is a single flow */
+static void reserve_slots(){
+	for(unsigned int b=0; b<FLOW_BUCKETS && !server; b++){
+		if(flows[b] != NULL) output_reserve(&flows[b]->out, BATCH_SIZE);
+	}
+}
+
+/* Receive the datagrams waiting on sfd in one batch, at least one
+ * @arg: whether the receiver goes on, cleared once it has everything
+ */
+void on_datagrams(int sfd, uint32_t events, void *arg){
+	(void) events;
+	bool *running = arg;
+	recv_batch_t in;
+	char *bufs[BATCH_SIZE];
+	flow_t *dirty[BATCH_SIZE]; // Flows whose output has to be flushed after the batch
+	reserve_slots();
+	for(int i=0; i<BATCH_SIZE; i++){
+		bufs[i] = spares[i]->data;
+	}
+	int n = recv_batch(sfd, &in, bufs, pool.slot_size, BATCH_SIZE, MSG_WAITFORONE);
+	if(n == -1){
+		ERROR("Error while reading sfd\n");
+		return;
+	}
+	DEBUG("Received a batch of %d datagrams\n", n);
+	int n_dirty = 0;
+	for(int i=0; i<n && *running; i++){
+		*running = receive_datagram(sfd, &spares[i], in.msgs[i].msg_len, &in.srcs[i], dirty, &n_dirty);
+	}
+	end_batch(sfd, dirty, n_dirty);
+}
+
+/* Receive loop on epoll: the socket is waited for until a delayed ACK is due or a flow expires */
 void receiver_handler(const int sfd){
-	struct pollfd fds[] = {{.fd=sfd, .events=POLLIN}};
-	int n_fds = 1;
-	int ret = 1;
-	int n_ret;
-	while(ret){
-		if(poll(fds, n_fds, -1) == -1){
-			ERROR("Error with poll()");
-		} else {
-			char buffer[MAX_PKT_SIZE];
-			if(fds[0].revents && POLLIN){
-				n_ret = read(fds[0].fd, buffer, MAX_PKT_SIZE);
-				if(n_ret==-1) {
-					ERROR("Error while reading sfd\n");
+	bool running = true;
+	acks.count = 0;
+	event_loop_t loop;
+	if(ev_init(&loop)){
+		return;
+	}
+	if(ev_watch(&loop, sfd, EPOLLIN, on_datagrams, &running)){
+		ev_destroy(&loop);
+		return;
+	}
+	while(running){
+		uint64_t deadline = timers_deadline();
+		/* Without any timer, the receive blocks until a datagram arrives and no wait is needed */
+		if(deadline == UINT64_MAX){
+			on_datagrams(sfd, EPOLLIN, &running);
+			continue;
+		}
+		/* The timers are also checked after a batch, a busy socket must not hold back the delayed ACKs */
+		if(ev_run(&loop, deadline) <= 0 || clock_us() >= deadline){
+			expire_timers(sfd);
+		}
+	}
+	ev_destroy(&loop);
+}
+
+/* Receive loop on io_uring (-u): a multishot receive fills the spare slots handed to the kernel, and a
+ * single io_uring_enter() submits the ACKs of a batch and waits for the next datagrams. The output is
+ * written through the ring as well, the ACKs go along with the write, and when no datagram is waiting
+ * yet the write also waits for the next one. The slots of a batch are handed back to the kernel once
+ * their payloads are written.
+ * @return: false if the kernel cannot receive with a multishot request, before any datagram was taken
+ */
+bool receiver_uring_handler(const int sfd){
+	flow_t *dirty[BATCH_SIZE];
+	uint16_t used[BATCH_SIZE]; // Buffers of the batch
+	int n = 0, n_dirty = 0;
+	bool running = true;
+	bool armed = false;
+	bool received = false;
+	acks.count = 0;
+	while(running){
+		bool ready = uring_next_cqe(&ring) != NULL;
+		if(n){
+			/* Without datagrams waiting, writing the batch also waits for the next one (or a timer). Not
+			 * when a flow finished, its file is closed right away, nor when the receive must be queued again */
+			bool finished = false;
+			for(int i=0; i<n_dirty; i++){
+				finished |= dirty[i]->done;
+			}
+			if(!ready && !finished && armed){
+				uring_wait_also(&ring, 1, timers_timeout());
+			}
+			end_batch(sfd, dirty, n_dirty);
+			uring_wait_also(&ring, 0, -1);
+			for(int i=0; i<n; i++){
+				uring_buf_put(&ring, spares[used[i]]->data, pool.slot_size, used[i]);
+			}
+			n = n_dirty = 0;
+			ready = uring_next_cqe(&ring) != NULL;
+		}
+		struct io_uring_sqe *sqe;
+		if(!armed && (sqe = uring_get_sqe(&ring)) != NULL){
+			uring_prep_recvmsg_multishot(sqe, sfd, &recv_msg, 0);
+			armed = true;
+		}
+		/* Datagrams may have come during the last batch already, the ACKs are still submitted right away */
+		if(!ready || uring_pending(&ring)){
+			uring_enter(&ring, !ready, ready ? -1 : timers_timeout());
+			if(!ready && uring_next_cqe(&ring) == NULL){
+				expire_timers(sfd);
+				continue;
+			}
+		}
+		reserve_slots();
+		struct io_uring_cqe *cqe;
+		while(n < BATCH_SIZE && running && (cqe = uring_next_cqe(&ring)) != NULL){
+			int res = cqe->res;
+			unsigned int flags = cqe->flags;
+			uring_cqe_seen(&ring);
+			if(!(flags & IORING_CQE_F_MORE)){
+				armed = false;
+			}
+			if(!(flags & IORING_CQE_F_BUFFER)){
+				/* Out of buffers, the receive is queued again once the batch gave them back */
+				if(res == -EINVAL && !received){
+					return false;
 				}
-				DEBUG("STARTING handle_packet()\n");
-				ret = handle_packet(buffer, n_ret);
-				DEBUG("handle_packet() returned %d\n", ret);
-				if(ret!=2){
-					DEBUG("Writing response to socket\n");
-					n_ret = write(sfd, buffer, RESP_LEN);
+				if(res != -ENOBUFS){
+					ERROR("Error while reading sfd: %s\n", strerror(-res));
 				}
+				continue;
+			}
+			received = true;
+			uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			used[n++] = bid;
+			struct sockaddr_in6 src;
+			size_t len;
+			if(uring_recvmsg_payload(spares[bid]->data, res, &recv_msg, &src, &len) != NULL){
+				running = receive_datagram(sfd, &spares[bid], len, &src, dirty, &n_dirty);
 			}
-			fflush(NULL);
 		}
+		DEBUG("Received a batch of %d datagrams\n", n);
 	}
+	end_batch(sfd, dirty, n_dirty);
+	/* The last ACK must have left before the ring is released */
+	uring_flush(&ring);
+	return true;
 }
 
-
 int main(int argc, char **argv) {
 	int opt;
-	char *stats_filename = NULL;
 	char *listen_ip = NULL;
 	char *listen_port_err;
 	uint16_t listen_port;
-	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+	while ((opt = getopt(argc, argv, "s:zo:a:muh")) != -1) {
 	  switch (opt) {
 	  case 'h':
 			return print_usage(argv[0]);
 	  case 's':
 			stats_filename = optarg;
 			break;
+	  case 'z':
+			splice_stdout = 1;
+			break;
+	  case 'o':
+			output_filename = optarg;
+			break;
+	  case 'a':
+			ack_every = (unsigned int) strtoul(optarg, NULL, 10);
+			if(!ack_every){
+				ERROR("The ACK count must be at least 1");
+				return print_usage(argv[0]);
+			}
+			break;
+	  case 'm':
+			server = true;
+			break;
+	  case 'u':
+			use_uring = true;
+			break;
 	  default:
 			return print_usage(argv[0]);
 	  }
@@ -205,6 +1124,10 @@ int main(int argc, char **argv) {
 		ERROR("Unexpected number of positional arguments");
 		return print_usage(argv[0]);
 	}
+	if (server && output_filename == NULL) {
+		ERROR("The server mode writes each transfer to its own file, -o is required");
+		return print_usage(argv[0]);
+	}
 
 	listen_ip = argv[optind];
 	listen_port = (uint16_t) strtol(argv[optind + 1], &listen_port_err, 10);
@@ -237,27 +1160,88 @@ int main(int argc, char **argv) {
 		close(sfd);
 		return EXIT_FAILURE;
 	}
+	/* Room for a burst of the large windows of the extended format */
+	socket_buffer = set_socket_buffers(sfd, SOCKET_BUFFER_SIZE);
 
-	/* Connection establishment */
-	if(wait_for_client(sfd) < 0) {
-		fprintf(stderr, "Could not connect the socket upon receiving the first message\n");
-		return EXIT_FAILURE;   
+	/* Pick the CRC32 kernel now rather than on the first packet */
+	crc_init();
+	if(inflateInit2(&inflater, -MAX_WBITS) != Z_OK){
+		ERROR("Could not initialize the decompression\n");
+		return EXIT_FAILURE;
 	}
+	tw_init(&ack_timers, clock_us());
+	tw_init(&idle_timers, clock_us());
 
-	DEBUG("Sender connected\n");
-
-	/* Data array initialization */
-	int i=0;
-	for(;i<N;i++){
-		window[i] = NULL;
+	/* io_uring needs a kernel that picks the receive buffers from a ring (5.19), otherwise epoll is used */
+	if(use_uring && (uring_init(&ring, 2*BATCH_SIZE, 4*URING_BUFFERS, RESP_LEN) || uring_buf_ring_init(&ring, URING_BUFFERS, 0))){
+		ERROR("io_uring is not available (%s), falling back to epoll", strerror(errno));
+		uring_exit(&ring);
+		use_uring = false;
+	}
+	if(use_uring){
+		recv_msg.msg_namelen = sizeof(struct sockaddr_in6);
+		recv_offset = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in6);
 	}
 
-	memset(&stats, 0, sizeof(stat_t));
+	/* Connection establishment: outside of server mode, the first sender is the only one */
+	size_t max_pending = 0;
+	if(!server){
+		if(wait_for_client(sfd) < 0) {
+			fprintf(stderr, "Could not connect the socket upon receiving the first message\n");
+			return EXIT_FAILURE;
+		}
+		struct sockaddr_in6 peer;
+		socklen_t peer_len = sizeof(peer);
+		memset(&peer, 0, sizeof(peer));
+		getpeername(sfd, (struct sockaddr*) &peer, &peer_len);
+		flow_t *flow = flow_new(&peer);
+		if(flow == NULL){
+			return EXIT_FAILURE;
+		}
+		max_pending = flow->out.max_pending;
+		DEBUG("Sender connected\n");
+	}
 
-	receiver_handler(sfd);
+	/* Slots may also be waiting in the output queue, or referenced by the pipe when splicing,
+	 * with one more slot per datagram of a batch to receive in, on top of the spare ones. The pool is sized
+	 * for the extended format, the pages of the slots never used are never touched */
+	unsigned int n_spares = use_uring ? URING_BUFFERS : BATCH_SIZE;
+	if(slot_pool_init(&pool, EXT_WINDOW_SIZE+BATCH_SIZE+n_spares+OUTPUT_MAX_IOV+max_pending, MAX_PKT_SIZE+recv_offset)){
+		return EXIT_FAILURE;
+	}
+	for(unsigned int i=0;i<n_spares;i++){
+		spares[i] = slot_get(&pool);
+		if(use_uring) uring_buf_put(&ring, spares[i]->data, pool.slot_size, i);
+	}
 
-	send_statistics(stats_filename);
+	if(use_uring && !receiver_uring_handler(sfd)){
+		ERROR("The kernel cannot receive with a multishot io_uring request, falling back to epoll");
+		for(unsigned int b=0; b<FLOW_BUCKETS; b++){
+			for(flow_t *flow = flows[b]; flow != NULL; flow = flow->next) flow->out.ring = NULL;
+		}
+		uring_exit(&ring);
+		use_uring = false;
+		recv_offset = 0;
+	}
+	if(!use_uring){
+		receiver_handler(sfd);
+	}
 
+	for(unsigned int b=0; b<FLOW_BUCKETS; b++){
+		while(flows[b] != NULL){
+			if(!flows[b]->done) flow_finish(flows[b]);
+			flow_free(flows[b]);
+		}
+	}
+	while(transfers != NULL){
+		ERROR("Striped transfer %u is missing stripes\n", transfers->number);
+		transfer_close(transfers);
+	}
+	if(use_uring){
+		uring_exit(&ring);
+	}
+	slot_pool_destroy(&pool);
+	inflateEnd(&inflater);
 	close(sfd);
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,79 @@
+#include "rtt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void rtt_init(rtt_t *rtt){
+	memset(rtt, 0, sizeof(rtt_t));
+	rtt->rto = RTO_INITIAL;
+	rtt->base_rto = RTO_INITIAL;
+	rtt->min = UINT32_MAX;
+	rtt->seed = 0x2545f491;
+}
+
+static uint32_t rtt_clamp(uint64_t rto){
+	if(rto < RTO_MIN) return RTO_MIN;
+	if(rto > RTO_MAX) return RTO_MAX;
+	return rto;
+}
+
+void rtt_sample(rtt_t *rtt, uint32_t sample){
+	if(!rtt->n_samples){
+		rtt->srtt = sample;
+		rtt->rttvar = sample / 2;
+	} else {
+		uint32_t delta = rtt->srtt > sample ? rtt->srtt - sample : sample - rtt->srtt;
+		rtt->rttvar = (3 * (uint64_t) rtt->rttvar + delta) / 4;
+		rtt->srtt = (7 * (uint64_t) rtt->srtt + sample) / 8;
+	}
+	/* The variance term never drops below RTO_MIN: on a steady path RTTVAR decays to almost
+	 * nothing and the RTO would fire as soon as a little queueing delays the ACKs */
+	uint64_t var = 4 * (uint64_t) rtt->rttvar;
+	rtt->base_rto = rtt_clamp(rtt->srtt + (var > RTO_MIN ? var : RTO_MIN));
+	rtt->rto = rtt->base_rto;
+	rtt->backoff = 0;
+
+	if(sample < rtt->min) rtt->min = sample;
+	if(sample > rtt->max) rtt->max = sample;
+
+	// Reservoir sampling keeps a uniform subset of all the samples
+	if(rtt->n_samples < RTT_RESERVOIR_SIZE){
+		rtt->samples[rtt->n_samples] = sample;
+	} else {
+		rtt->seed = rtt->seed * 1103515245 + 12345;
+		uint64_t idx = ((uint64_t) rtt->seed << 16 ^ rtt->seed) % (rtt->n_samples + 1);
+		if(idx < RTT_RESERVOIR_SIZE) rtt->samples[idx] = sample;
+	}
+	rtt->n_samples++;
+}
+
+void rtt_backoff(rtt_t *rtt){
+	rtt->rto = rtt_clamp((uint64_t) rtt->rto * 2);
+	rtt->backoff++;
+}
+
+uint32_t rtt_rto(const rtt_t *rtt){
+	return rtt->rto;
+}
+
+uint32_t rtt_base_rto(const rtt_t *rtt){
+	return rtt->base_rto;
+}
+
+static int rtt_compare(const void *a, const void *b){
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+uint32_t rtt_percentile(const rtt_t *rtt, double p){
+	size_t n = rtt->n_samples < RTT_RESERVOIR_SIZE ? rtt->n_samples : RTT_RESERVOIR_SIZE;
+	if(!n) return 0;
+	uint32_t *sorted = (uint32_t*) malloc(n * sizeof(uint32_t));
+	if(sorted == NULL) return 0;
+	memcpy(sorted, rtt->samples, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), rtt_compare);
+	size_t idx = (size_t) (p / 100 * (n - 1) + 0.5);
+	uint32_t ret = sorted[idx < n ? idx : n - 1];
+	free(sorted);
+	return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef __RTT_H_
+#define __RTT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounds of the retransmission timeout, in microseconds */
+#define RTO_INITIAL 1000000
+#define RTO_MIN 20000
+#define RTO_MAX 60000000
+/* Number of samples kept to compute the percentiles */
+#define RTT_RESERVOIR_SIZE 4096
+
+/* Round-trip time estimator (SRTT/RTTVAR as in RFC 6298) driving the
+ * retransmission timeout. All durations are in microseconds.
+ */
+typedef struct rtt {
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint32_t base_rto;       /* RTO given by the samples, without backoff */
+	unsigned int backoff;    /* Number of times the RTO was doubled since the last sample */
+	uint32_t min;
+	uint32_t max;
+	uint64_t n_samples;
+	uint32_t samples[RTT_RESERVOIR_SIZE]; /* Uniform reservoir of the samples */
+	uint32_t seed;
+} rtt_t;
+
+/* Reset the estimator, the RTO starts at RTO_INITIAL */
+void rtt_init(rtt_t *rtt);
+
+/* Feed a new measure. Following Karn's rule, the caller must not feed
+ * measures of packets that were retransmitted.
+ * The RTO is recomputed and the backoff is reset.
+ */
+void rtt_sample(rtt_t *rtt, uint32_t sample);
+
+/* Double the RTO after a retransmission timeout, up to RTO_MAX */
+void rtt_backoff(rtt_t *rtt);
+
+/* Current retransmission timeout */
+uint32_t rtt_rto(const rtt_t *rtt);
+
+/* Retransmission timeout given by the samples, ignoring the backoff */
+uint32_t rtt_base_rto(const rtt_t *rtt);
+
+/* The p-th percentile (0 <= p <= 100) of the samples, 0 if there are none */
+uint32_t rtt_percentile(const rtt_t *rtt, double p);
+
+#endif // __RTT_H_
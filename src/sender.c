@@ -7,25 +7,191 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <time.h>
 #include <errno.h>
+#include <zlib.h>
 
 #include "log.h"
 #include "socket_helpers.h"
 #include "packet.h"
 #include "config.h"
+#include "slot_pool.h"
+#include "crc.h"
+#include "clock.h"
+#include "rtt.h"
+#include "timer_wheel.h"
+#include "cc.h"
+#include "pacing.h"
+#include "spsc_ring.h"
+#include "uring.h"
+#include "event_loop.h"
 
-pkt_t* windows[N];
-uint8_t start_window = 0;
-uint8_t size_window = 0;
-uint8_t next_seqnum = 0;
-time_t timeout_counter = 0;
+/* Largest ACK: a full selective acknowledgement in the extended format */
+#define ACK_MAX_LEN (EXT_HEADER_SIZE + SACK_MAX_SIZE + 4)
+
+/* Source of the data to send: a file descriptor, or the whole file mapped in memory.
+ * With io_uring (-u), a file descriptor is read ahead by chains of linked reads into free slots,
+ * see read_ahead()
+ * @reading: slots of the chain being read, in order, from head on
+ * @fixed: the pool is registered with the ring, the reads use IORING_OP_READ_FIXED
+ */
+typedef struct input {
+	int fd;
+	const char* map; // NULL when the data is read from fd
+	size_t map_size; // Length of the mapping
+	size_t size;     // End of the data to send, short of map_size for a stripe
+	size_t offset;   // Next byte of the mapping to send
+	uring_t* ring;   // NULL when the data is read()
+	bool fixed;
+	slot_t* reading[BATCH_SIZE];
+	int head;
+	int n_reading;
+} input_t;
+
+/* The input thread reads the data and encodes the frames ahead of the network thread, which sends
+ * them, handles the ACKs and the retransmissions and never waits for the input.
+ * The pool belongs to the input thread, the network thread gives the acknowledged slots back through
+ * recycled. Each thread sleeps on an eventfd when it runs out of work, after raising its waiting flag
+ * so that the other one knows it has to write to it.
+ * @frames: slots holding the next data packets, in sequence, up to the EOT
+ * @recycled: slots released by the network thread
+ * @data_efd: readable when frames got new slots while the network thread was waiting
+ * @space_efd: readable when slots were released while the input thread was waiting
+ * @failed: the input could not be read, nothing more will come
+ * @stop: the network thread is done, the input thread must leave
+ */
+typedef struct pipeline {
+	spsc_ring_t frames;
+	spsc_ring_t recycled;
+	int data_efd;
+	int space_efd;
+	int net_waiting;
+	int input_waiting;
+	int failed;
+	int stop;
+	pthread_t thread;
+} pipeline_t;
+
+/* Compression of the payloads (-z), by the input thread only
+ * @stream: raw deflate stream, reset for every payload so that each packet inflates on its own
+ * @skip: payloads to send as they are since the last one that did not compress
+ * @skipped: payloads sent as they are so far since then
+ * @packets: payloads sent compressed
+ * @saved: bytes the compression saved
+ */
+typedef struct compressor {
+	z_stream stream;
+	uint32_t skip;
+	uint32_t skipped;
+	uint64_t packets;
+	uint64_t saved;
+} compressor_t;
+
+/* Loss rates are fractions of LOSS_ONE */
+#define LOSS_ONE (1 << 20)
+
+/* Forward error correction (-e): the input thread closes each group of data packets with a repair
+ * packet, see PTYPE_REPAIR. The network thread sizes the groups after the loss rate it observes,
+ * and holds back the fast retransmit of a packet whose repair may still rebuild it.
+ * @loss: moving average of the fraction of the packets lost, out of LOSS_ONE (network thread)
+ * @group: size of the next groups, 0 while the losses are too rare for repairs to pay off
+ *         (written by the network thread, read by the input thread)
+ * @repair: repair packet of the open group, NULL if no group is open (input thread)
+ * @id: number of the last group opened, the Window of its packets (input thread)
+ * @count: packets in the open group so far, which is closed at size (input thread)
+ * @size: packets per group, set when the group opens (input thread)
+ * @longest: longest payload of the open group (input thread)
+ * @length: XOR of the lengths of the payloads of the open group (input thread)
+ * @first: first packet of each group whose repair was sent and that is still in flight (network thread)
+ * @end: sequence number following each of these groups
+ * @head: index of the oldest of these groups in first and end, n_groups of them are in flight
+ * @reported: sequence number following the furthest packet reported by the last selective acknowledgement
+ * @pending: repairs queued in out_batch, their slots are given back once it is flushed (network thread)
+ */
+typedef struct fec_state {
+	uint32_t loss;
+	uint32_t group;
+	slot_t* repair;
+	uint32_t id;
+	uint16_t count;
+	uint16_t size;
+	uint16_t longest;
+	uint16_t length;
+	uint32_t first[EXT_WINDOW_SIZE];
+	uint32_t end[EXT_WINDOW_SIZE];
+	uint32_t head;
+	uint32_t n_groups;
+	uint32_t reported;
+	slot_t* pending[BATCH_SIZE];
+	int n_pending;
+} fec_state_t;
+
+input_t input;
+pipeline_t pipeline;
+slot_pool_t pool;
+slot_t* windows[EXT_WINDOW_SIZE];
+/* The original format keeps N packets in flight, numbered modulo MAX_SEQ_SIZE. The extended
+ * format, when the receiver accepts it, keeps EXT_WINDOW_SIZE of them with 32-bit numbers */
+bool extended = false;
+uint32_t window_cap = N;
+uint32_t seq_mask = MAX_SEQ_SIZE - 1;
+size_t header_size = DATA_HEADER_SIZE;
+uint16_t payload_size = MAX_PAYLOAD_SIZE; // Size of every payload but the last one
+send_batch_t out_batch;
+uint32_t base_seqnum = 0; // Oldest packet not acknowledged yet
+uint32_t next_seqnum = 0;
+uint32_t sacked = 0; // Packets in flight the receiver already holds
+/* Fast retransmit: duplicates of the cumulative ACK seen so far, and the first packet sent
+ * after the last fast retransmit while the packets before it are being recovered */
+int dup_ack_threshold = DUP_ACK_THRESHOLD; // 0 disables it
+uint32_t dup_acks = 0;
+bool recovering = false;
+uint32_t recover_seqnum = 0;
+uint32_t receiver_window = 1; // New packets the receiver can take
+bool eot = false;
+uint64_t timeout_counter = 0;
+uint32_t silence_rto = 0; // RTO when the receiver was last heard of, the linger does not grow with later backoffs
 stat_t stats;
+rtt_t rtt;
+timer_wheel_t timers;
+cc_t cc;
+pacer_t pacer;
+uint64_t pacing_rate = 0; // Configured rate in bytes per second, 0 to derive it from the congestion window
+uint32_t rto_stamp = 0; // Timestamp of the first retransmission after a timeout of the oldest packet
+/* Striped transfer (-k): the file is split in stripe.stripes byte ranges, each one sent by its own
+ * process over its own flow. stripe.stripes is 0 when the whole file goes over a single flow */
+hello_opts_t stripe;
+bool stripe_accepted = false;
+/* Compression offered with -z, used once the receiver accepted it */
+bool offer_compress = false;
+bool compressing = false;
+compressor_t compressor;
+/* Repair packets offered with -e, sent once the receiver accepted them */
+bool offer_fec = false;
+bool fec = false;
+fec_state_t fec_state;
+/* Input read through io_uring (-u), the ring belongs to the input thread */
+bool use_uring = false;
+uring_t ring;
 
 int print_usage(char *prog_name) {
-    ERROR("Usage:\n\t%s [-f filename] [-s stats_filename] receiver_ip receiver_port", prog_name);
+    ERROR("Usage:\n\t%s [-f filename] [-s stats_filename] [-x] [-d threshold] [-c algorithm] [-r rate] [-k stripes] [-z] [-e] [-u] receiver_ip receiver_port", prog_name);
+    ERROR("\t-x: offer the extended format (32-bit sequence numbers, windows of %d packets) to the receiver", EXT_WINDOW_SIZE - 1);
+    ERROR("\t-d: duplicate ACKs before the oldest packet is retransmitted without waiting for its timer (default %d, 0 disables it)", DUP_ACK_THRESHOLD);
+    ERROR("\t-c: congestion control: none (default) only follows the receiver window, reno or cubic");
+    ERROR("\t-r: pace the packets at rate kB/s, by default reno and cubic pace them at the congestion window per RTT");
+    ERROR("\t-k: split the file (-f is required) in stripes sent in parallel over their own flows, the receiver must run with -m.");
+    ERROR("\t    Implies -x, the statistics of each stripe go to stats_filename.i");
+    ERROR("\t-z: compress the payloads that shrink with deflate, if the receiver accepts it. Implies -x");
+    ERROR("\t-e: follow groups of packets with a repair packet that rebuilds one lost packet without a retransmission,");
+    ERROR("\t    the groups are sized after the loss rate, if the receiver accepts it. Implies -x");
+    ERROR("\t-u: read an input that cannot be mapped through io_uring, %d payloads ahead, with read() if the kernel does not support it", BATCH_SIZE);
     return EXIT_FAILURE;
 }
 
@@ -45,184 +211,1135 @@ void send_statistics(const char* filename){
 	fprintf(fd, "nack_sent,%d\n", stats.nack_sent);
 	fprintf(fd, "nack_received,%d\n", stats.nack_received);
 	fprintf(fd, "packets_ignored,%d\n", stats.packet_ignored);
-	fprintf(fd, "min_rtt,%d\n", stats.min_rtt*1000);
-	fprintf(fd, "max_rtt,%d\n", stats.max_rtt*1000);
+	fprintf(fd, "min_rtt,%d\n", stats.min_rtt);
+	fprintf(fd, "max_rtt,%d\n", stats.max_rtt);
 	fprintf(fd, "packets_retransmitted,%d\n", stats.packet_retransmitted);
+	fprintf(fd, "fast_retransmits,%d\n", stats.fast_retransmits);
+	fprintf(fd, "repairs_sent,%d\n", stats.repairs_sent);
+	fprintf(fd, "rtt_p50_us,%u\n", rtt_percentile(&rtt, 50));
+	fprintf(fd, "rtt_p90_us,%u\n", rtt_percentile(&rtt, 90));
+	fprintf(fd, "rtt_p99_us,%u\n", rtt_percentile(&rtt, 99));
+	fprintf(fd, "srtt_us,%u\n", rtt.srtt);
+	fprintf(fd, "rto_us,%u\n", rtt_rto(&rtt));
+	fprintf(fd, "cwnd,%u\n", cc.cwnd);
+	fprintf(fd, "packets_compressed,%lu\n", (unsigned long) compressor.packets);
+	fprintf(fd, "bytes_saved,%lu\n", (unsigned long) compressor.saved);
+	fprintf(fd, "syscalls,%lu\n", io_syscalls);
 
 	if(fd != stderr){
 		fclose(fd);
 	}
 }
 
+static inline uint32_t window_idx(uint32_t seqnum){
+	return seqnum & (window_cap - 1);
+}
+
+static inline uint32_t in_flight(){
+	return (next_seqnum - base_seqnum) & seq_mask;
+}
+
+/*
+ * Network thread: count a packet released by a cumulative ACK in the loss rate, and size the next
+ * FEC groups so that a group loses (group + 1) * loss < 1/4 packets on average
+ */
+void fec_sample(const slot_t* slot){
+	fec_state.loss -= fec_state.loss >> FEC_LOSS_SHIFT;
+	if(slot->missed || slot->transmissions > 1){
+		fec_state.loss += LOSS_ONE >> FEC_LOSS_SHIFT;
+	}
+	uint32_t group = 0;
+	if(4 * (FEC_MAX_GROUP + 1) * fec_state.loss >= LOSS_ONE){
+		group = LOSS_ONE / (4 * fec_state.loss);
+		group = group > FEC_MIN_GROUP + 1 ? group - 1 : FEC_MIN_GROUP;
+	}
+	__atomic_store_n(&fec_state.group, group, __ATOMIC_RELAXED);
+}
+
 /*
- *	Clear all packets received to a valid seqnum and update de start_window value to the next not yet received packet
+ *	Clear all packets received to a valid seqnum and update base_seqnum to the next not yet received packet
+ *	@return: -1 if recv_seqnum does not acknowledge a packet in flight (old or duplicated ACK), 0 otherwise
  */
-void clear_received_packets(int recv_seqnum){
-	int idx = recv_seqnum % N;
-	while(start_window != idx){
-		pkt_del(windows[start_window]);
-		windows[start_window] = NULL;
-		size_window++;
-		start_window = (start_window + 1) % N;
-	}	
+int clear_received_packets(uint32_t recv_seqnum){
+	if(((recv_seqnum - base_seqnum) & seq_mask) > in_flight()){
+		return -1;
+	}
+	while(base_seqnum != recv_seqnum){
+		uint32_t idx = window_idx(base_seqnum);
+		if(windows[idx] != NULL){
+			if(windows[idx]->sacked) sacked--;
+			if(fec) fec_sample(windows[idx]);
+			tw_cancel(&timers, &windows[idx]->timer);
+			spsc_push(&pipeline.recycled, windows[idx]);
+			windows[idx] = NULL;
+		}
+		base_seqnum = (base_seqnum + 1) & seq_mask;
+	}
+	return 0;
 }
 
-/* 
- * Create and send a new data packet over the socket
+/*
+ *	Stop retransmitting the packets that a selective acknowledgement reports as received,
+ *	they stay in the window until the cumulative ACK passes them. The packets left out before
+ *	the last one reported are missing, which the loss rate of the FEC counts
+ *	@return: the number of packets newly reported
  */
-pkt_t* create_and_save_packet_data(char* buffer, int len){
-	// Maybe checking return values of setters would be a good idea
-	// Create a new packet and set corresponding fields
-	pkt_t* new_pkt = pkt_new();
-	pkt_set_type(new_pkt, 1);
-	pkt_set_seqnum(new_pkt, next_seqnum);
-	time_t second = 0;
-	time(&second);
-	pkt_set_timestamp(new_pkt, second);
-	pkt_set_payload(new_pkt, buffer, len);
+uint32_t mark_sacked(uint32_t ack_seqnum, const char* sack, uint16_t length){
+	uint32_t flying = in_flight();
+	uint32_t newly = 0;
+	uint32_t reported = 0; // Packets from ack_seqnum up to the last one reported
+	for(uint32_t i=0; i<8 * (uint32_t) length; i++){
+		if(!(sack[i / 8] & 0x80 >> (i % 8))) continue;
+		uint32_t seqnum = (ack_seqnum + 1 + i) & seq_mask;
+		if(((seqnum - base_seqnum) & seq_mask) >= flying) break;
+		reported = i + 2;
+		slot_t* slot = windows[window_idx(seqnum)];
+		if(slot != NULL && slot->pkt.seqnum == seqnum && !slot->sacked){
+			DEBUG("Seqnum %u selectively acknowledged\n", seqnum);
+			slot->sacked = true;
+			tw_cancel(&timers, &slot->timer);
+			sacked++;
+			newly++;
+		}
+	}
+	fec_state.reported = (ack_seqnum + reported) & seq_mask;
+	for(uint32_t i=0; fec && i<reported; i++){
+		uint32_t seqnum = (ack_seqnum + i) & seq_mask;
+		slot_t* slot = windows[window_idx(seqnum)];
+		if(slot != NULL && slot->pkt.seqnum == seqnum && !slot->sacked){
+			slot->missed = true;
+		}
+	}
+	return newly;
+}
 
-	windows[next_seqnum % N] = new_pkt;
+/*
+ *	The receiver takes window more packets, those it already holds out of order are not counted
+ *	twice. The packets in flight may never span more than the window buffers.
+ */
+void update_receiver_window(uint32_t window){
+	uint32_t flying = in_flight();
+	uint32_t missing = flying - sacked;
+	if(window > window_cap - 1){
+		window = window_cap - 1;
+	}
+	receiver_window = window > missing ? window - missing : 0;
+	if(receiver_window > window_cap - 1 - flying){
+		receiver_window = window_cap - 1 - flying;
+	}
+}
 
-	next_seqnum = (next_seqnum + 1) % MAX_SEQ_SIZE;
+/*
+ *	New packets that may leave now: the receiver must have room for them and the packets
+ *	still in the network must leave room in the congestion window
+ */
+static inline uint32_t send_window(){
+	uint32_t missing = in_flight() - sacked;
+	uint32_t room = cc.cwnd > missing ? cc.cwnd - missing : 0;
+	return room < receiver_window ? room : receiver_window;
+}
 
-	return new_pkt;
+/* Switch to the extended format, before anything is sent */
+void set_extended(bool ext){
+	extended = ext;
+	window_cap = ext ? EXT_WINDOW_SIZE : N;
+	seq_mask = ext ? UINT32_MAX : MAX_SEQ_SIZE - 1;
+	header_size = ext ? EXT_HEADER_SIZE : DATA_HEADER_SIZE;
 }
 
-void encode_and_send_packet_data(pkt_t* pkt, int fd){
-	DEBUG("Sending packet, seqnum %d\n", pkt->seqnum);
-	size_t length = MAX_PKT_SIZE;
-	char* new_buffer = (char*) malloc(length);
-	time_t second = 0;
-	time(&second);
-	pkt_set_timestamp(pkt, second);
-	pkt_status_code ret = pkt_encode(pkt, new_buffer, &length);
-	
+/*
+ * Map the input in memory if it is a regular file, so that packets can be sent straight from the page cache
+ * @return: 0 if the input is mapped, -1 if it must be read()
+ */
+int map_input(input_t* in){
+	struct stat st;
+	off_t start = lseek(in->fd, 0, SEEK_CUR);
+	if(fstat(in->fd, &st) == -1 || !S_ISREG(st.st_mode) || start == -1 || st.st_size <= start){
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if(map == MAP_FAILED){
+		DEBUG("Could not map the input, falling back to read()\n");
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	in->map = map;
+	in->map_size = st.st_size;
+	in->size = st.st_size;
+	in->offset = start;
+	return 0;
+}
+
+/*
+ * Input thread: deflate a payload into its slot if it shrinks by 1/COMPRESS_MIN_GAIN at least.
+ * Data that does not compress costs little: after a payload that did not shrink, the next ones
+ * are sent as they are, twice as many after each further failure up to COMPRESS_MAX_SKIP.
+ * @payload: payload_size bytes at most, in the slot or in the mapped input
+ * @return: the length of the compressed payload, now at slot->data + header_size, or 0 if the
+ *          payload must be sent as it is
+ */
+uint16_t compress_payload(slot_t* slot, const char* payload, uint16_t length){
+	if(compressor.skipped < compressor.skip){
+		compressor.skipped++;
+		return 0;
+	}
+	/* A payload read into the slot cannot be deflated in place */
+	static char scratch[EXT_MAX_PAYLOAD_SIZE];
+	char* dest = slot->data + header_size;
+	char* out = payload == dest ? scratch : dest;
+	z_stream* z = &compressor.stream;
+	deflateReset(z);
+	z->next_in = (Bytef*) payload;
+	z->avail_in = length;
+	z->next_out = (Bytef*) out;
+	z->avail_out = length - length / COMPRESS_MIN_GAIN;
+	if(deflate(z, Z_FINISH) != Z_STREAM_END){
+		compressor.skip = compressor.skip ? 2 * compressor.skip : 1;
+		if(compressor.skip > COMPRESS_MAX_SKIP){
+			compressor.skip = COMPRESS_MAX_SKIP;
+		}
+		compressor.skipped = 0;
+		return 0;
+	}
+	compressor.skip = 0;
+	if(out != dest){
+		memcpy(dest, out, z->total_out);
+	}
+	compressor.packets++;
+	compressor.saved += length - z->total_out;
+	return z->total_out;
+}
+
+/*
+ * Input thread: read() the rest of a payload, up to payload_size bytes or the end of the input
+ * @done: bytes of the payload already read
+ * @return: the size of the payload, -1 on read() errors
+ */
+int read_payload(char* payload, int done){
+	while(done < payload_size){
+		count_syscall();
+		ssize_t r = read(input.fd, payload + done, payload_size - done);
+		if(r == 0) break;
+		if(r == -1){
+			if(errno == EINTR) continue;
+			ERROR("Error while reading input\n");
+			return -1;
+		}
+		done += r;
+	}
+	return done;
+}
+
+/*
+ * Input thread (-u): take the next payload read through the ring. When no read is in flight, one
+ * is queued into each free slot, up to BATCH_SIZE, and they are linked so that they complete in
+ * order with a single system call. Anything but a full payload breaks the chain: the reads after
+ * it are cancelled, their slots go back to the pool, and the payload is completed with read().
+ * @n_read: set to the size of the payload, 0 for the EOT, or to -1 on errors
+ * @return: the slot holding the payload, NULL on errors
+ */
+slot_t* read_ahead(int* n_read){
+	if(!input.n_reading){
+		int count = pool.n_free < BATCH_SIZE ? pool.n_free : BATCH_SIZE;
+		for(int i=0; i<count; i++){
+			slot_t* slot = slot_get(&pool);
+			struct io_uring_sqe* sqe = uring_get_sqe(input.ring);
+			uring_prep_rw(sqe, input.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, input.fd,
+			              slot->data + header_size, payload_size, -1, (uint64_t) (uintptr_t) slot);
+			if(i + 1 < count){
+				sqe->flags |= IOSQE_IO_LINK;
+			}
+			input.reading[i] = slot;
+		}
+		input.head = 0;
+		input.n_reading = count;
+	}
+	slot_t* slot = input.reading[input.head++];
+	input.n_reading--;
+	int res = uring_wait_for(input.ring, (uint64_t) (uintptr_t) slot);
+	if(res != payload_size){
+		while(input.n_reading){
+			slot_t* cancelled = input.reading[input.head++];
+			input.n_reading--;
+			uring_wait_for(input.ring, (uint64_t) (uintptr_t) cancelled);
+			slot_put(&pool, cancelled);
+		}
+		if(res < 0){
+			ERROR("Error while reading input: %s\n", strerror(-res));
+		}
+		res = res < 0 ? -1 : read_payload(slot->data + header_size, res);
+	}
+	*n_read = res;
+	if(res == -1){
+		slot_put(&pool, slot);
+		return NULL;
+	}
+	return slot;
+}
+
+/*
+ * Input thread: take the next payload from the input and make it a data packet in a free slot,
+ * its CRC2 is computed once here. A mapped input is referenced in place, otherwise it is read
+ * straight into the slot. A payload that compresses (-z) is deflated into the slot.
+ * Only the last payload may be shorter than payload_size so that the receiver can write
+ * each payload at seqnum * payload_size: short reads are completed.
+ * @seqnum: sequence number of the packet
+ * @n_read: set to the size of the payload, 0 for the EOT, or to -1 on read errors
+ * @return: the slot holding the packet, NULL on errors
+ */
+slot_t* read_packet_data(uint32_t seqnum, int* n_read){
+	slot_t* slot;
+	char* payload;
+	if(input.map != NULL){
+		slot = slot_get(&pool);
+		payload = (char*) input.map + input.offset;
+		*n_read = input.size - input.offset < payload_size ? input.size - input.offset : payload_size;
+		input.offset += *n_read;
+	} else if(input.ring != NULL){
+		slot = read_ahead(n_read);
+		if(slot == NULL){
+			return NULL;
+		}
+		payload = slot->data + header_size;
+	} else {
+		slot = slot_get(&pool);
+		payload = slot->data + header_size;
+		*n_read = read_payload(payload, 0);
+		if(*n_read == -1){
+			slot_put(&pool, slot);
+			return NULL;
+		}
+	}
+
+	// Set the corresponding fields, the payload is already in place
+	pkt_t* new_pkt = &slot->pkt;
+	pkt_set_ext(new_pkt, extended);
+	pkt_set_type(new_pkt, PTYPE_DATA);
+	pkt_set_seqnum(new_pkt, seqnum);
+	pkt_set_length(new_pkt, *n_read);
+	new_pkt->payload = payload;
+	new_pkt->flags = 0;
+
+	// Only the length of the payload on the wire changes, the receiver inflates it back to n_read bytes
+	uint16_t compressed = compressing && *n_read ? compress_payload(slot, payload, *n_read) : 0;
+	if(compressed){
+		pkt_set_length(new_pkt, compressed);
+		new_pkt->payload = slot->data + header_size;
+		new_pkt->flags = PKT_FLAG_DEFLATE;
+	}
+
+	// Only the timestamp changes between transmissions, the payload CRC is computed once
+	bool in_slot = new_pkt->payload == slot->data + header_size;
+	if(predict_packet_length(new_pkt) - header_size - new_pkt->length){
+		pkt_encode_crc2(new_pkt, slot->data + header_size + (in_slot ? new_pkt->length : 0));
+	}
+	return slot;
+}
+
+/*
+ * Input thread: complete the repair packet of the open FEC group, which is closed
+ * @return: the repair packet, NULL if no group is open
+ */
+slot_t* fec_close(){
+	slot_t* repair = fec_state.repair;
+	if(repair == NULL){
+		return NULL;
+	}
+	char* payload = repair->data + header_size;
+	uint16_t count = htons(fec_state.count), length = htons(fec_state.length);
+	memcpy(payload, &count, 2);
+	memcpy(payload + 2, &length, 2);
+	pkt_set_length(&repair->pkt, REPAIR_HEADER_SIZE + fec_state.longest);
+	repair->pkt.payload = payload;
+	pkt_encode_crc2(&repair->pkt, payload + repair->pkt.length);
+	fec_state.repair = NULL;
+	return repair;
+}
+
+/*
+ * Input thread: add a data packet to the open FEC group. A group is opened when repairs are due
+ * and the pool has a slot for its repair, otherwise the packet is not protected
+ * @return: the repair packet if the group is now complete, NULL otherwise
+ */
+slot_t* fec_protect(slot_t* slot){
+	pkt_t* pkt = &slot->pkt;
+	if(fec_state.repair == NULL){
+		uint32_t size = __atomic_load_n(&fec_state.group, __ATOMIC_RELAXED);
+		if(!size || !pool.n_free){
+			return NULL;
+		}
+		slot_t* repair = slot_get(&pool);
+		fec_state.id = fec_state.id + 1 ? fec_state.id + 1 : 1;
+		fec_state.size = size;
+		fec_state.count = 0;
+		fec_state.longest = 0;
+		fec_state.length = 0;
+		pkt_set_ext(&repair->pkt, extended);
+		pkt_set_type(&repair->pkt, PTYPE_REPAIR);
+		pkt_set_seqnum(&repair->pkt, pkt->seqnum);
+		pkt_set_window(&repair->pkt, fec_state.id);
+		fec_state.repair = repair;
+	}
+	pkt->flags |= PKT_FLAG_FEC;
+	pkt_set_window(pkt, fec_state.id);
+
+	// The parity only covers the longest payload so far, the bytes past it are copied
+	char* parity = fec_state.repair->data + header_size + REPAIR_HEADER_SIZE;
+	repair_xor(parity, pkt->payload, pkt->length < fec_state.longest ? pkt->length : fec_state.longest);
+	if(pkt->length > fec_state.longest){
+		memcpy(parity + fec_state.longest, pkt->payload + fec_state.longest, pkt->length - fec_state.longest);
+		fec_state.longest = pkt->length;
+	}
+	fec_state.length ^= pkt->length;
+	fec_state.repair->pkt.flags ^= pkt->flags;
+	return ++fec_state.count == fec_state.size ? fec_close() : NULL;
+}
+
+/* Wake the other thread up if it is waiting on efd, after the ring it waits for changed */
+static inline void pipeline_notify(int *waiting, int efd){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)){
+		uint64_t one = 1;
+		count_syscall();
+		if(write(efd, &one, sizeof(one)) == -1){
+			ERROR("Could not wake the other thread up\n");
+		}
+	}
+}
+
+/*
+ * Input thread: encode the packets up to the EOT as long as frames and the pool have room.
+ * A repair packet follows the last packet of its group, and comes before the EOT.
+ */
+void* input_stage(void* arg){
+	(void) arg;
+	uint32_t seqnum = 0;
+	slot_t* ready[2]; // Packets encoded but not pushed yet, in order
+	int n_ready = 0;
+	/* The ring is only used by the thread that created it. Reads into a registered pool skip the
+	 * mapping of the pages at each read, a pool too large to pin is read into as it is */
+	if(use_uring && input.map == NULL){
+		if(uring_init(&ring, BATCH_SIZE, 2 * BATCH_SIZE, 0)){
+			ERROR("io_uring is not available (%s), reading with read()\n", strerror(errno));
+		} else {
+			input.ring = &ring;
+			size_t arena = pool.count * pool.slot_size;
+			input.fixed = arena <= URING_REGISTER_MAX && !uring_register_buffer(&ring, pool.arena, arena);
+		}
+	}
+	while(!__atomic_load_n(&pipeline.stop, __ATOMIC_ACQUIRE)){
+		slot_t* slot;
+		while((slot = spsc_pop(&pipeline.recycled)) != NULL){
+			slot_put(&pool, slot);
+		}
+		if(spsc_full(&pipeline.frames) || (!n_ready && !pool.n_free && !input.n_reading)){
+			/* Check again once the flag is up, the network thread may have missed it */
+			__atomic_store_n(&pipeline.input_waiting, 1, __ATOMIC_SEQ_CST);
+			if(!__atomic_load_n(&pipeline.stop, __ATOMIC_SEQ_CST) &&
+			   (spsc_full(&pipeline.frames) ||
+			    (!n_ready && !pool.n_free && !input.n_reading && spsc_empty(&pipeline.recycled)))){
+				uint64_t count;
+				count_syscall();
+				if(read(pipeline.space_efd, &count, sizeof(count)) == -1 && errno != EINTR){
+					ERROR("Could not wait for the network thread\n");
+				}
+			}
+			__atomic_store_n(&pipeline.input_waiting, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if(n_ready){
+			slot = ready[0];
+			ready[0] = ready[1];
+			n_ready--;
+			spsc_push(&pipeline.frames, slot);
+			pipeline_notify(&pipeline.net_waiting, pipeline.data_efd);
+			if(slot->pkt.type == PTYPE_DATA && !slot->pkt.length){
+				break;
+			}
+			continue;
+		}
+		int n_read;
+		slot = read_packet_data(seqnum, &n_read);
+		if(slot == NULL){
+			__atomic_store_n(&pipeline.failed, 1, __ATOMIC_RELEASE);
+			pipeline_notify(&pipeline.net_waiting, pipeline.data_efd);
+			break;
+		}
+		slot_t* repair = !fec ? NULL : n_read ? fec_protect(slot) : fec_close();
+		if(repair != NULL && !n_read){
+			ready[n_ready++] = repair;
+		}
+		ready[n_ready++] = slot;
+		if(repair != NULL && n_read){
+			ready[n_ready++] = repair;
+		}
+		seqnum = (seqnum + 1) & seq_mask;
+	}
+	if(input.ring != NULL){
+		uring_exit(input.ring);
+	}
+	return NULL;
+}
+
+/* Start the input thread, once the format and the payload size are known
+ * @return: 0 in case of success, -1 otherwise
+ */
+int pipeline_start(){
+	pipeline.data_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pipeline.space_efd = eventfd(0, EFD_CLOEXEC);
+	if(pipeline.data_efd == -1 || pipeline.space_efd == -1){
+		ERROR("Could not create the eventfds of the pipeline");
+		return -1;
+	}
+	if(spsc_init(&pipeline.frames, SENDER_RING_SIZE) || spsc_init(&pipeline.recycled, pool.count)){
+		return -1;
+	}
+	if(pthread_create(&pipeline.thread, NULL, input_stage, NULL)){
+		ERROR("Could not start the input thread");
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop the input thread, wherever it is, and release the pipeline */
+void pipeline_stop(){
+	__atomic_store_n(&pipeline.stop, 1, __ATOMIC_SEQ_CST);
+	uint64_t one = 1;
+	if(write(pipeline.space_efd, &one, sizeof(one)) == -1){
+		ERROR("Could not stop the input thread\n");
+	}
+	pthread_join(pipeline.thread, NULL);
+	spsc_destroy(&pipeline.frames);
+	spsc_destroy(&pipeline.recycled);
+	close(pipeline.data_efd);
+	close(pipeline.space_efd);
+}
+
+/*
+ * Network thread: take the next frame encoded by the input thread into the window,
+ * repair packets stay out of it
+ * @return: the slot holding the packet, or NULL if none is ready yet
+ */
+slot_t* next_packet_data(){
+	slot_t* slot = spsc_pop(&pipeline.frames);
+	if(slot == NULL || slot->pkt.type == PTYPE_REPAIR){
+		return slot;
+	}
+	windows[window_idx(next_seqnum)] = slot;
+	next_seqnum = (next_seqnum + 1) & seq_mask;
+	return slot;
+}
+
+/*
+ * (Re)encode a packet in its own slot with a fresh timestamp, queue it to be sent over the socket
+ * and arm its retransmission timer.
+ * The slot always holds the header. The CRC2 follows the payload when it was read into the slot,
+ * otherwise it comes right after the header and the datagram is gathered from three pieces.
+ * The extended format has no CRC2 for the EOT packet.
+ */
+void encode_and_send_packet_data(slot_t* slot, int fd){
+	pkt_t* pkt = &slot->pkt;
+	DEBUG("Sending packet, seqnum %u\n", pkt->seqnum);
+	bool in_slot = pkt->payload == slot->data + header_size;
+	char* crc2 = slot->data + header_size + (in_slot ? pkt->length : 0);
+	size_t crc2_len = predict_packet_length(pkt) - header_size - pkt->length;
+
+	// The CRC2 was computed by the input thread, only the header is encoded again
+	pkt_set_timestamp(pkt, clock_stamp());
+	size_t length = header_size;
+	pkt_status_code ret = pkt_encode_header(pkt, slot->data, &length);
 	if(ret){
 	  	ERROR("Error while encoding data packet.\n");
-	}	
+		return;
+	}
+	slot->transmissions++;
+	slot->frame_len = header_size + pkt->length + crc2_len;
+	tw_schedule(&timers, &slot->timer, clock_us() + rtt_rto(&rtt));
+
+	if(in_slot){
+		ret = send_batch_queue(fd, &out_batch, slot->data, slot->frame_len);
+	} else {
+		struct iovec iov[] = {
+			{.iov_base = slot->data, .iov_len = header_size},
+			{.iov_base = pkt->payload, .iov_len = pkt->length},
+			{.iov_base = crc2, .iov_len = crc2_len},
+		};
+		ret = send_batch_queuev(fd, &out_batch, iov, 3);
+	}
+	if(ret) {
+		ERROR("Error with send_batch_queue() in encode_and_send_packet_data()\n");
+	}
+}
+
+/*
+ * Send the queued packets, the slots of the repair packets among them can then be reused
+ */
+void flush_packets(int fd){
+	send_batch_flush(fd, &out_batch);
+	for(int i=0; i<fec_state.n_pending; i++){
+		spsc_push(&pipeline.recycled, fec_state.pending[i]);
+	}
+	fec_state.n_pending = 0;
+}
+
+/*
+ * Queue a repair packet with a fresh timestamp. It is sent once: it has no timer and takes no
+ * room in the windows. The group it closes is remembered while it is in flight, see detect_loss()
+ */
+void send_repair(slot_t* slot, int fd){
+	pkt_t* pkt = &slot->pkt;
+	pkt_set_timestamp(pkt, clock_stamp());
+	size_t length = header_size;
+	if(pkt_encode_header(pkt, slot->data, &length)){
+		ERROR("Error while encoding repair packet.\n");
+		spsc_push(&pipeline.recycled, slot);
+		return;
+	}
+	if(fec_state.n_pending == BATCH_SIZE){
+		flush_packets(fd);
+	}
+	slot->frame_len = header_size + pkt->length + 4;
+	if(send_batch_queue(fd, &out_batch, slot->data, slot->frame_len)){
+		ERROR("Error with send_batch_queue() in send_repair()\n");
+	}
+	fec_state.pending[fec_state.n_pending++] = slot;
+	stats.repairs_sent += 1;
+
+	uint16_t count;
+	memcpy(&count, pkt->payload, 2);
+	if(fec_state.n_groups < EXT_WINDOW_SIZE){
+		uint32_t idx = (fec_state.head + fec_state.n_groups++) & (EXT_WINDOW_SIZE - 1);
+		fec_state.first[idx] = pkt->seqnum;
+		fec_state.end[idx] = pkt->seqnum + ntohs(count);
+	}
+}
+
+/*
+ * Pace at the configured rate, or spread the congestion window over the smoothed RTT: twice
+ * as fast in slow start so that the window can still double every RTT, 1.25 times afterwards
+ * to make up for the gaps. Nothing is paced without congestion control nor before an RTT sample.
+ */
+void update_pacing_rate(){
+	if(pacing_rate){
+		pacer_set_rate(&pacer, pacing_rate);
+	} else if(cc.ops == &cc_none || !rtt.srtt){
+		pacer_set_rate(&pacer, 0);
+	} else {
+		uint64_t rate = (uint64_t) cc.cwnd * (header_size + payload_size + 4) * 1000000 / rtt.srtt;
+		pacer_set_rate(&pacer, cc.cwnd < cc.ssthresh ? 2 * rate : rate * 5 / 4);
+	}
+}
 
-	size_t n_ret = write(fd, new_buffer, length);
-	if(n_ret != length) {
-		ERROR("Error with write() in encode_and_send_packet_data()\n");
-		ERROR("Bytes written: %lu, Bytes expected: %lu\n", n_ret, length);
+/*
+ * A new packet may leave: the windows have room for it and the pacing allows it now,
+ * otherwise the pacing timer is armed for when it will
+ */
+static inline bool may_send(){
+	return send_window() && !eot && pacer_ready(&pacer, header_size + payload_size + 4, clock_us());
+}
+
+/*
+ * Send as many of the frames encoded by the input thread as the windows and the pacing allow,
+ * they leave in one batch
+ * @return: -1 if the input could not be read, 0 otherwise
+ */
+int send_new_packets(int sfd){
+	for(int k=0; k<BATCH_SIZE && may_send(); k++){
+		slot_t* slot = next_packet_data();
+		if(slot == NULL){
+			return __atomic_load_n(&pipeline.failed, __ATOMIC_ACQUIRE) ? -1 : 0;
+		}
+		if(slot->pkt.type == PTYPE_REPAIR){
+			send_repair(slot, sfd);
+			pacer_consume(&pacer, slot->frame_len);
+			continue;
+		}
+		stats.data_sent += 1;
+		receiver_window--;
+		encode_and_send_packet_data(slot, sfd);
+		pacer_consume(&pacer, slot->frame_len);
+
+		if(!slot->pkt.length){
+			DEBUG("EOT received\n");
+			eot=true;
+			timeout_counter = clock_us();
+			silence_rto = rtt_rto(&rtt);
+		}
 	}
+	return 0;
+}
+
+/*
+ * The RTO is doubled when the oldest packet in flight times out, as the single timer of RFC 6298 would.
+ * Backing off for every packet of a large window would reach RTO_MAX after a few losses.
+ */
+void retransmit_packet(tw_timer_t* timer, void* arg){
+	slot_t* slot = TW_ENTRY(timer, slot_t, timer);
+	DEBUG("Retransmitting seqnum %u\n", slot->pkt.seqnum);
+	stats.packet_retransmitted += 1;
+	if(slot->pkt.seqnum == base_seqnum){
+		rtt_backoff(&rtt);
+		if(!cc.undo){
+			rto_stamp = clock_stamp();
+		}
+		cc_on_timeout(&cc, clock_us());
+	}
+	encode_and_send_packet_data(slot, *(int*) arg);
+}
+
+/*
+ * Retransmit every packet of the window whose own timer expired
+ */
+void resend_timedout_packet(int sfd){
+	tw_advance(&timers, clock_us(), retransmit_packet, &sfd);
+}
 
-	free(new_buffer);
+/*
+ * Whether the repair packet of the group of the oldest packet in flight may still rebuild it: the
+ * repair was sent, but the receiver has not reported any packet sent after the group yet.
+ * A packet whose group is still open is not waited for, its group may never be completed
+ * while it holds the window back.
+ */
+bool fec_awaits_repair(){
+	slot_t* head = windows[window_idx(base_seqnum)];
+	if(!fec || head == NULL || head->pkt.seqnum != base_seqnum || !(head->pkt.flags & PKT_FLAG_FEC)){
+		return false;
+	}
+	while(fec_state.n_groups && (int32_t) (fec_state.end[fec_state.head] - base_seqnum) <= 0){
+		fec_state.head = (fec_state.head + 1) & (EXT_WINDOW_SIZE - 1);
+		fec_state.n_groups--;
+	}
+	if(!fec_state.n_groups || (int32_t) (base_seqnum - fec_state.first[fec_state.head]) < 0){
+		return false;
+	}
+	return (int32_t) (fec_state.reported - fec_state.end[fec_state.head]) <= 0;
 }
 
-void resend_timedout_packet(int sfd, int timeout){
-	uint8_t idx = start_window;
-	time_t second = 0;
-	time(&second);
-	while(windows[idx] != NULL && (difftime(windows[idx]->timestamp, second-(timeout/1000)) <= 0)){
-		DEBUG("Retransmitting\n");
-		stats.packet_retransmitted += 1;
-		encode_and_send_packet_data(windows[idx], sfd);
-		idx = (idx + 1) % N;
+/*
+ * Fast retransmit: the receiver repeats its cumulative ACK for every packet arriving past a hole,
+ * the oldest packet is resent after dup_ack_threshold duplicates instead of waiting for its timer.
+ * Once per window: until recover_seqnum is acknowledged, the duplicates only come from packets
+ * sent before the retransmission, so only a partial ACK (NewReno) resends the next hole.
+ * In the extended format, only the ACKs reporting packets newly received out of order count as
+ * duplicates (RFC 6675): the ACKs of packets received twice after a spurious timeout do not.
+ * With FEC, the oldest packet is not resent while its repair may still rebuild it: a later duplicate
+ * resends it if the repair did not, during the recovery as well.
+ * @advanced: the ACK released packets
+ * @duplicate: the ACK tells that a packet past the hole arrived
+ */
+void detect_loss(int sfd, bool advanced, bool duplicate){
+	if(!dup_ack_threshold || !in_flight()){
+		dup_acks = 0;
+		recovering = false;
+		return;
+	}
+	if(advanced){
+		dup_acks = 0;
+		uint32_t left = (recover_seqnum - base_seqnum) & seq_mask;
+		if(!recovering || !left || left > in_flight()){
+			recovering = false;
+			return;
+		}
+	} else if(!duplicate || (!recovering && ++dup_acks < (uint32_t) dup_ack_threshold)){
+		return;
 	}
+	slot_t* head = windows[window_idx(base_seqnum)];
+	if(head == NULL || head->pkt.seqnum != base_seqnum || head->sacked ||
+	   (!advanced && recovering && head->transmissions > 1) || fec_awaits_repair()){
+		return;
+	}
+	DEBUG("Fast retransmit of seqnum %u\n", base_seqnum);
+	if(!recovering){
+		cc_on_loss(&cc, clock_us());
+	}
+	recovering = true;
+	recover_seqnum = next_seqnum;
+	stats.packet_retransmitted += 1;
+	stats.fast_retransmits += 1;
+	encode_and_send_packet_data(head, sfd);
 }
 
-void compute_rtt(int timestamp){
-	time_t now = 0;
-	time(&now);
-	int time = now - timestamp;
-	if(time < stats.min_rtt){
-		stats.min_rtt = time*1000;
+/*
+ * Feed the RTT estimator with the timestamp echoed by an ACK, before the acknowledged packets are released.
+ * Karn's rule: nothing is learnt if the last packet newly acknowledged was retransmitted
+ */
+void compute_rtt(uint32_t timestamp, uint32_t ack_seqnum){
+	uint32_t last_seqnum = (ack_seqnum - 1) & seq_mask;
+	slot_t* acked = windows[window_idx(last_seqnum)];
+	if(acked == NULL || acked->pkt.seqnum != last_seqnum || acked->transmissions != 1){
+		return;
 	}
-	if(time > stats.max_rtt){
-		stats.max_rtt = time*1000;
+	uint32_t sample = clock_stamp_elapsed(timestamp);
+	if(sample > RTO_MAX){
+		return;
 	}
+	rtt_sample(&rtt, sample);
+	stats.min_rtt = rtt.min / 1000;
+	stats.max_rtt = rtt.max / 1000;
 }
 
-void sender_handler(const int sfd, int fdin){
-	struct pollfd fds[] = {{.fd=sfd, .events=POLLIN},{.fd=fdin, .events=POLLIN}};
-	int n_fds = 2;
-	int timeout = 5000;
-	bool eot = false;
-	bool end = false;
-	uint8_t receiver_window = 1;
-	int n_read = 0;
-	while(!end && n_read != -1){
+/* Encode a control frame with a fresh timestamp and send it right away */
+void send_frame(const int sfd, pkt_t* pkt){
+	static char buf[MAX_PKT_SIZE];
+	size_t len = sizeof(buf);
+	pkt_set_timestamp(pkt, clock_stamp());
+	if(pkt_encode(pkt, buf, &len) || send(sfd, buf, len, 0) == -1){
+		DEBUG("Could not send a frame of type %d\n", pkt->type);
+	}
+}
 
-		if(poll(fds, n_fds, timeout) == -1){
-			ERROR("Error with poll()\n");
+/*
+ * Wait until deadline for a frame of the extended format
+ * @buf: buffer of MAX_PKT_SIZE bytes, view references it
+ * @return: true if a frame was decoded in view, false once the deadline is over
+ */
+bool wait_frame(const int sfd, uint64_t deadline, char* buf, pkt_view_t* view){
+	uint64_t now;
+	while((now = clock_us()) < deadline){
+		struct pollfd pfd = {.fd=sfd, .events=POLLIN};
+		if(poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0){
+			continue;
+		}
+		ssize_t n = recv(sfd, buf, MAX_PKT_SIZE, 0);
+		if(n > 0 && !pkt_decode_view(buf, n, view) && view->ext){
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Send a HELLO frame with the given options, again every RTO up to HELLO_ATTEMPTS times,
+ * until the receiver answers with its own HELLO.
+ * A receiver which only knows the original format drops the frame and never answers.
+ * @answer: set to the options of the receiver
+ * @return: true if the receiver answered
+ */
+bool hello_exchange(const int sfd, const hello_opts_t* offer, hello_opts_t* answer){
+	char opts[HELLO_OPTS_SIZE];
+	pkt_t hello;
+	memset(&hello, 0, sizeof(pkt_t));
+	pkt_set_ext(&hello, 1);
+	pkt_set_type(&hello, PTYPE_HELLO);
+	pkt_set_window(&hello, EXT_WINDOW_SIZE - 1);
+	pkt_set_length(&hello, hello_encode_opts(offer, opts));
+	hello.payload = opts;
+
+	static char buf[MAX_PKT_SIZE];
+	for(int attempt=0; attempt<HELLO_ATTEMPTS; attempt++){
+		send_frame(sfd, &hello);
+		uint64_t deadline = clock_us() + rtt_rto(&rtt);
+		pkt_view_t view;
+		while(wait_frame(sfd, deadline, buf, &view)){
+			if(view.type != PTYPE_HELLO || hello_decode_opts(view.payload, view.length, answer)){
+				continue;
+			}
+			/* Karn's rule, the answer may be to an earlier HELLO */
+			if(!attempt){
+				rtt_sample(&rtt, clock_stamp_elapsed(view.timestamp));
+			}
+			receiver_window = view.window < EXT_WINDOW_SIZE - 1 ? view.window : EXT_WINDOW_SIZE - 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Find the largest payload that reaches the receiver, up to max_payload. A PROBE frame of each
+ * candidate size is sent with the don't fragment bit, the receiver echoes the size of the ones
+ * it got. Candidates are the path MTU known by the kernel, the usual jumbo, Ethernet and IPv6
+ * minimum MTUs, and the size of a full frame of the original format for the paths which only
+ * carry those. The probes still unanswered are sent again, up to HELLO_ATTEMPTS times.
+ * @return: the payload size to use, 0 if no probe went through
+ */
+uint16_t probe_path_mtu(const int sfd, uint16_t max_payload){
+	int mtu = path_mtu(sfd);
+	uint32_t candidates[] = {max_payload, 9000 - EXT_FRAME_OVERHEAD, 1500 - EXT_FRAME_OVERHEAD,
+		1280 - EXT_FRAME_OVERHEAD, EXT_SAFE_PAYLOAD_SIZE};
+	if(mtu > EXT_FRAME_OVERHEAD && (uint32_t) mtu - EXT_FRAME_OVERHEAD < max_payload){
+		candidates[0] = mtu - EXT_FRAME_OVERHEAD;
+	}
+	uint16_t best = 0;
+
+	static char zeros[EXT_MAX_PAYLOAD_SIZE];
+	static char buf[MAX_PKT_SIZE];
+	set_dont_fragment(sfd, 1);
+	for(int attempt=0; attempt<HELLO_ATTEMPTS && best < candidates[0]; attempt++){
+		for(size_t i=0; i<sizeof(candidates)/sizeof(candidates[0]); i++){
+			if(candidates[i] <= best || candidates[i] > candidates[0]) continue;
+			pkt_t probe;
+			memset(&probe, 0, sizeof(pkt_t));
+			pkt_set_ext(&probe, 1);
+			pkt_set_type(&probe, PTYPE_PROBE);
+			pkt_set_seqnum(&probe, candidates[i]);
+			pkt_set_length(&probe, candidates[i]);
+			probe.payload = zeros;
+			send_frame(sfd, &probe);
+		}
+		uint64_t deadline = clock_us() + rtt_rto(&rtt);
+		pkt_view_t view;
+		while(best < candidates[0] && wait_frame(sfd, deadline, buf, &view)){
+			if(view.type == PTYPE_PROBE && view.seqnum > best && view.seqnum <= candidates[0]){
+				best = view.seqnum;
+			}
+		}
+	}
+	set_dont_fragment(sfd, 0);
+	DEBUG("Path MTU probing: payloads of %u bytes\n", best);
+	return best;
+}
+
+/*
+ * Offer the extended format, then agree on the payload size: the largest one that both
+ * ends accept and that went through the path. Repair packets are REPAIR_HEADER_SIZE bytes
+ * longer than the data packets, the payloads leave room for it when they are sent.
+ * @return: true if the receiver accepted the extended format
+ */
+bool negotiate_extended(const int sfd){
+	hello_opts_t offer = stripe, answer;
+	offer.max_payload = EXT_MAX_PAYLOAD_SIZE;
+	offer.compress = offer_compress ? COMPRESS_DEFLATE : COMPRESS_NONE;
+	offer.fec = offer_fec ? FEC_XOR : FEC_NONE;
+	if(!hello_exchange(sfd, &offer, &answer)){
+		return false;
+	}
+	stripe_accepted = answer.stripes && answer.stripe_id == stripe.stripe_id && answer.stripe == stripe.stripe;
+	compressing = offer_compress && answer.compress == COMPRESS_DEFLATE;
+	fec = offer_fec && answer.fec == FEC_XOR && answer.max_payload;
+	if(answer.max_payload){
+		/* Both ends start with frames no larger than the legacy ones, they are kept when no
+		 * probe comes back or the receiver never confirms the probed size */
+		uint16_t reserve = fec ? REPAIR_HEADER_SIZE : 0;
+		payload_size = EXT_SAFE_PAYLOAD_SIZE;
+		offer.payload = probe_path_mtu(sfd, answer.max_payload < offer.max_payload ? answer.max_payload : offer.max_payload);
+		if(!offer.payload){
+			offer.payload = EXT_SAFE_PAYLOAD_SIZE;
+		}
+		offer.payload -= reserve;
+		if(offer.payload != EXT_SAFE_PAYLOAD_SIZE){
+			if(hello_exchange(sfd, &offer, &answer) && answer.payload == offer.payload){
+				payload_size = offer.payload;
+			} else {
+				/* The receiver may have taken the probed size and only its confirmation got lost:
+				 * it must agree on the fallback before any data, or the original format is used */
+				offer.payload = EXT_SAFE_PAYLOAD_SIZE;
+				fec = false;
+				if(!hello_exchange(sfd, &offer, &answer) || answer.payload != EXT_SAFE_PAYLOAD_SIZE){
+					payload_size = MAX_PAYLOAD_SIZE;
+					stripe_accepted = compressing = false;
+					return false;
+				}
+			}
+		}
+		/* The repair packets of full payloads would not fit */
+		if(fec && payload_size != offer.payload){
+			fec = false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Network thread: handle the ACKs and NACKs waiting on the socket
+ * @arg: the end of the transfer, set once the EOT is acknowledged
+ */
+void on_acks(int sfd, uint32_t events, void* arg){
+	(void) events;
+	bool* end = arg;
+	static char buffers[BATCH_SIZE][ACK_MAX_LEN];
+	recv_batch_t in_batch;
+	DEBUG("Reading from socket\n");
+	char *bufs[BATCH_SIZE];
+	for(int k=0; k<BATCH_SIZE; k++){
+		bufs[k] = buffers[k];
+	}
+	int n = recv_batch(sfd, &in_batch, bufs, ACK_MAX_LEN, BATCH_SIZE, MSG_DONTWAIT);
+	if(n == -1){
+		perror("Couldn't read socket\n");
+	}
+	for(int k=0; k<n; k++){
+		pkt_view_t ack;
+		int ret = pkt_decode_view(buffers[k], in_batch.msgs[k].msg_len, &ack);
+		if(ret) {
+			ERROR("Error with pkt_decode() %d\n", ret);
+		} else if(ack.ext != extended) {
+			stats.packet_ignored += 1;
 		} else {
-			char buffer[MAX_PAYLOAD_SIZE];
-			pkt_t* pkt = NULL;
-
-			for(int i=0; i<n_fds; i++){
-
-				if(!fds[i].revents) continue;
-
-				if(fds[i].fd==fdin && receiver_window && !eot){
-					DEBUG("Reading from stdin\n");
-					stats.data_sent += 1;
-					receiver_window--;
-					size_window--;
-					n_read = read(fds[i].fd, buffer, MAX_PAYLOAD_SIZE);
-					pkt = create_and_save_packet_data(buffer, n_read);
-					encode_and_send_packet_data(pkt, sfd);
-
-					if(n_read==0){
-						DEBUG("EOT received\n");
-						eot=true;
-						time(&timeout_counter);
-						fds[1].fd = -1;
-						n_fds = 1;
+			if(timeout_counter){
+				timeout_counter = clock_us();
+				silence_rto = rtt_rto(&rtt);
+			}
+			if(ack.type == PTYPE_ACK){
+				DEBUG("ack.type is PTYPE_ACK\n");
+				stats.ack_received += 1;
+
+				compute_rtt(ack.timestamp, ack.seqnum);
+
+				if(eot && ack.seqnum == next_seqnum) *end = true;
+
+				DEBUG("ack.seqnum %u, next_seqnum %u\n", ack.seqnum, next_seqnum);
+
+				/* Queued frames must leave before their slots can be reused */
+				if(out_batch.count){
+					flush_packets(sfd);
+				}
+				uint32_t old_base = base_seqnum;
+				if(!clear_received_packets(ack.seqnum)){
+					uint32_t acked = (base_seqnum - old_base) & seq_mask;
+					uint32_t newly_sacked = 0;
+					if(extended && ack.length){
+						newly_sacked = mark_sacked(ack.seqnum, ack.payload, ack.length);
+						acked += newly_sacked;
 					}
-				} else if (fds[i].fd==sfd) {
-					DEBUG("Reading from socket\n");
-					n_read = read(fds[i].fd, buffer, MAX_PAYLOAD_SIZE);
-					if(n_read == -1){
-						perror("Couldn't read socket\n");
-					}else{
-						pkt = pkt_new();
-						int ret = pkt_decode(buffer, n_read, pkt);
-						if(ret) {
-							ERROR("Error with pkt_decode() %d\n", ret);
-						} else {
-							if(timeout_counter){
-								time(&timeout_counter);
-							}
-							if(pkt->type == PTYPE_ACK){
-								DEBUG("pkt->type is PTYPE_ACK\n");
-								stats.ack_received += 1;
-								
-								compute_rtt(pkt->timestamp);
-
-								if(stats.max_rtt > timeout){
-									timeout = stats.max_rtt;
-								}
-								
-								if(eot && pkt->seqnum == next_seqnum) end = true;
-
-								DEBUG("pkt->seqnum %d, next_seqnum %d\n", pkt->seqnum, next_seqnum);
-								
-								clear_received_packets(pkt->seqnum);
-
-								if(pkt->window > size_window){
-									receiver_window = pkt->window;
-								}
-							} else if(pkt->type == PTYPE_NACK){
-								DEBUG("pkt->type is PTYPE_NACK\n");
-								stats.nack_received += 1;
-								encode_and_send_packet_data(windows[pkt->seqnum%N], sfd);
-							}
-						}
-						pkt_del(pkt);
+					update_receiver_window(ack.window);
+					/* The ACK releasing the packet that timed out tells whether it was triggered
+					 * before the retransmission, then the original made it and the RTO was too short */
+					if(cc.undo && base_seqnum != old_base){
+						if((int32_t) (ack.timestamp - rto_stamp) < 0) cc_undo(&cc);
+						else cc_commit(&cc);
 					}
+					detect_loss(sfd, base_seqnum != old_base, !extended || newly_sacked);
+					/* The window does not grow while the holes are being recovered */
+					if(acked && !recovering){
+						cc_on_ack(&cc, acked, rtt.srtt, clock_us());
+					}
+				}
+			} else if(ack.type == PTYPE_NACK){
+				DEBUG("ack.type is PTYPE_NACK\n");
+				stats.nack_received += 1;
+				slot_t* nacked = windows[window_idx(ack.seqnum)];
+				if(nacked != NULL && nacked->pkt.seqnum == ack.seqnum){
+					encode_and_send_packet_data(nacked, sfd);
 				}
 			}
+		}
+	}
+}
+
+/* Network thread: the input thread pushed frames while it was waiting for them */
+void on_frames(int efd, uint32_t events, void* arg){
+	(void) events;
+	(void) arg;
+	uint64_t count;
+	count_syscall();
+	if(read(efd, &count, sizeof(count)) == -1){
+		DEBUG("Input eventfd read before it was written\n");
+	}
+}
+
+/*
+ * Network thread: send the frames, handle the ACKs and the retransmissions until the EOT is acknowledged.
+ * A single wait covers the socket, the input thread and the earliest of the retransmission timers,
+ * the pacing and the end of the linger, to the microsecond
+ * @return: true if the EOT was acknowledged, false if the sender gave up or could not go on
+ */
+bool sender_handler(const int sfd){
+	bool end = false;
+	bool gave_up = false;
+	int failed = 0;
+	out_batch.count = 0;
+
+	/* The input is only watched while packets may leave, otherwise it would wake us up in a loop */
+	event_loop_t loop;
+	if(ev_init(&loop)){
+		return false;
+	}
+	if(ev_watch(&loop, sfd, EPOLLIN, on_acks, &end) || ev_watch(&loop, pipeline.data_efd, 0, on_frames, NULL)){
+		ev_destroy(&loop);
+		return false;
+	}
+	while(!end && !gave_up && failed != -1){
+
+		/* Give up on the last ACK once the receiver has been silent for 4 RTOs (at least 4 initial RTOs),
+		 * plus the backed off RTO it was last heard with so that the oldest packet gets retransmitted in
+		 * the meantime. The receiver leaves as soon as it has everything: once its last ACK is lost, the
+		 * retransmissions are never answered and backing off further must not keep the sender waiting */
+		uint64_t linger = 4 * (uint64_t) (rtt_base_rto(&rtt) > RTO_INITIAL ? rtt_base_rto(&rtt) : RTO_INITIAL) + silence_rto;
+		/* Sleep until the next retransmission is due */
+		uint64_t deadline = tw_next_expiry(&timers);
+		if(timeout_counter && timeout_counter + linger < deadline){
+			deadline = timeout_counter + linger;
+		}
+		/* Frames already encoded can leave right away, otherwise the input thread wakes us up
+		 * once it pushed one, the flag is raised before the ring is checked again so none is missed.
+		 * When only the pacing holds them back, we wake up once they may leave */
+		update_pacing_rate();
+		bool ready = may_send();
+		if(ready){
+			__atomic_store_n(&pipeline.net_waiting, 1, __ATOMIC_SEQ_CST);
+			if(!spsc_empty(&pipeline.frames) || __atomic_load_n(&pipeline.failed, __ATOMIC_ACQUIRE)){
+				__atomic_store_n(&pipeline.net_waiting, 0, __ATOMIC_SEQ_CST);
+				deadline = 0;
+			}
+		} else if(send_window() && !eot && pacer.wake < deadline){
+			deadline = pacer.wake;
+		}
+		ev_set_events(&loop, pipeline.data_efd, ready ? EPOLLIN : 0);
+		int run = ev_run(&loop, deadline);
+		__atomic_store_n(&pipeline.net_waiting, 0, __ATOMIC_SEQ_CST);
+		if(run != -1){
+			failed = send_new_packets(sfd);
 			fflush(NULL);
 		}
-		time_t now = 0;
-		time(&now);
-		if(timeout_counter && (now-timeout_counter >= ((timeout*4)/1000))){
-		  	end = true;
+		if(timeout_counter && (clock_us() - timeout_counter >= linger)){
+		  	gave_up = true;
 		}else{	  
-			resend_timedout_packet(sfd, timeout);
+			resend_timedout_packet(sfd);
+		}
+		flush_packets(sfd);
+		/* The input thread only waits for a full ring (the pool has room for the window on top of it),
+		 * it is woken up once half of it is free rather than for every frame taken */
+		if(spsc_size(&pipeline.frames) <= SENDER_RING_SIZE / 2){
+			pipeline_notify(&pipeline.input_waiting, pipeline.space_efd);
 		}
 	}
+	ev_destroy(&loop);
+	return end;
+}
+
+/*
+ * Split the file in stripes of about the same size and fork a process for each one. The children
+ * go on with their own flow, the parent waits for all of them.
+ * @end: set, in a child, to the end of its stripe (stripe holds the rest)
+ * @status: set, in the parent, to EXIT_SUCCESS if all the stripes were sent
+ * @return: true in a child, false in the parent
+ */
+bool fork_stripes(int fd, uint16_t stripes, uint64_t* end, int* status){
+	struct stat st;
+	*status = EXIT_FAILURE;
+	if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)){
+		ERROR("Only a regular file can be striped\n");
+		return false;
+	}
+	uint32_t id = (uint32_t) clock_us() ^ ((uint32_t) getpid() << 16);
+	pid_t pids[stripes];
+	for(uint16_t i=0; i<stripes; i++){
+		pids[i] = fork();
+		if(pids[i] == -1){
+			ERROR("Could not fork the sender of stripe %u\n", i);
+			stripes = i;
+			break;
+		}
+		if(!pids[i]){
+			stripe.stripe_id = id;
+			stripe.stripes = stripes;
+			stripe.stripe = i;
+			stripe.stripe_offset = (uint64_t) st.st_size * i / stripes;
+			*end = (uint64_t) st.st_size * (i + 1) / stripes;
+			return true;
+		}
+	}
+	bool failed = false;
+	for(uint16_t i=0; i<stripes; i++){
+		int child;
+		if(waitpid(pids[i], &child, 0) == -1 || !WIFEXITED(child) || WEXITSTATUS(child) != EXIT_SUCCESS){
+			ERROR("The sender of stripe %u failed\n", i);
+			failed = true;
+		}
+	}
+	*status = failed || !stripes ? EXIT_FAILURE : EXIT_SUCCESS;
+	return false;
 }
 
 int main(int argc, char **argv) {
@@ -234,8 +1351,50 @@ int main(int argc, char **argv) {
 	char *receiver_port_err;
 	uint16_t receiver_port;
 
-	while ((opt = getopt(argc, argv, "f:s:h")) != -1) {
+	bool offer_extended = false;
+	const cc_ops_t* cc_ops = &cc_none;
+	int stripes = 1;
+	while ((opt = getopt(argc, argv, "f:s:xd:c:r:k:zeuh")) != -1) {
 		switch (opt) {
+		case 'k':
+			stripes = atoi(optarg);
+			if(stripes < 1 || stripes > UINT16_MAX){
+				return print_usage(argv[0]);
+			}
+			break;
+		case 'r':
+			pacing_rate = strtoull(optarg, NULL, 10) * 1000;
+			if(!pacing_rate){
+				return print_usage(argv[0]);
+			}
+			break;
+		case 'c':
+			cc_ops = cc_find(optarg);
+			if(cc_ops == NULL){
+				ERROR("Unknown congestion control %s", optarg);
+				return print_usage(argv[0]);
+			}
+			break;
+		case 'x':
+			offer_extended = true;
+			break;
+		case 'z':
+			offer_compress = true;
+			offer_extended = true;
+			break;
+		case 'e':
+			offer_fec = true;
+			offer_extended = true;
+			break;
+		case 'u':
+			use_uring = true;
+			break;
+		case 'd':
+			dup_ack_threshold = atoi(optarg);
+			if(dup_ack_threshold < 0){
+				return print_usage(argv[0]);
+			}
+			break;
 		case 'f':
 			filename = optarg;
 			break;
@@ -270,6 +1429,26 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	/* From here on, each stripe is sent by its own process */
+	uint64_t stripe_end = 0;
+	char stripe_stats[PATH_MAX];
+	if(stripes > 1){
+		if(filename == NULL){
+			ERROR("Striping needs a file (-f)");
+			return print_usage(argv[0]);
+		}
+		int status;
+		if(!fork_stripes(fd, stripes, &stripe_end, &status)){
+			close(fd);
+			return status;
+		}
+		offer_extended = true;
+		if(stats_filename != NULL){
+			snprintf(stripe_stats, sizeof(stripe_stats), "%s.%u", stats_filename, stripe.stripe);
+			stats_filename = stripe_stats;
+		}
+	}
+
 	// Create the socket to connect with receiver
 	struct sockaddr_in6 addr;
 	const char *err = real_address(receiver_ip, &addr);
@@ -284,21 +1463,91 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	memset(windows, 0, sizeof(windows));
+	/* Pick the CRC32 kernel now rather than on the first packet */
+	crc_init();
 
 	memset(&stats, 0, sizeof(stat_t));
-	stats.min_rtt = INT_MAX;
-	stats.max_rtt= INT_MIN;
+	rtt_init(&rtt);
+	tw_init(&timers, clock_us());
+
+	if(offer_extended){
+		set_extended(negotiate_extended(sfd));
+		if(stripe.stripes && !stripe_accepted){
+			ERROR("The receiver did not accept stripe %u, it must serve several senders (-m)\n", stripe.stripe);
+			return EXIT_FAILURE;
+		}
+		if(!extended){
+			ERROR("The receiver does not support the extended format, falling back to the original one\n");
+		} else {
+			set_socket_buffers(sfd, SOCKET_BUFFER_SIZE);
+		}
+		if(offer_compress && !compressing){
+			ERROR("The receiver does not accept compressed payloads, sending them as they are\n");
+		}
+		if(offer_fec && !fec){
+			ERROR("The receiver does not accept repair packets, sending none\n");
+		}
+	}
+	/* Fastest level: the input thread must keep up with the network */
+	if(compressing && deflateInit2(&compressor.stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+		ERROR("Could not initialize the compression\n");
+		return EXIT_FAILURE;
+	}
+
+	cc_init(&cc, cc_ops, window_cap - 1);
+	pacer_init(&pacer, PACING_BURST * (header_size + payload_size + 4), clock_us());
+
+	memset(windows, 0, sizeof(windows));
+	/* The input thread encodes up to SENDER_RING_SIZE frames ahead of the window. With FEC, it also
+	 * builds a repair packet while the repairs of up to a batch wait to be sent. With io_uring,
+	 * it reads up to a batch of payloads ahead */
+	if(slot_pool_init(&pool, window_cap + SENDER_RING_SIZE + (fec ? BATCH_SIZE + 1 : 0) + (use_uring ? BATCH_SIZE : 0),
+	                  header_size + payload_size + 4 + (fec ? REPAIR_HEADER_SIZE : 0))){
+		return EXIT_FAILURE;
+	}
+
+	memset(&input, 0, sizeof(input_t));
+	input.fd = fd;
+	if(!map_input(&input)){
+		DEBUG("Input mapped, %lu bytes to send\n", input.size - input.offset);
+	}
+	if(stripe.stripes){
+		/* A stripe may be empty, only its EOT is then sent */
+		if(input.map != NULL){
+			input.offset = stripe.stripe_offset;
+			input.size = stripe_end;
+		} else if(stripe_end > stripe.stripe_offset){
+			ERROR("Could not map the stripe\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if(pipeline_start()){
+		return EXIT_FAILURE;
+	}
 
 	/* Process I/O */
-	sender_handler(sfd, fd);
+	bool acknowledged = sender_handler(sfd);
+	pipeline_stop();
+	/* A receiver in server mode answers the EOT for FLOW_LINGER us, while a single one leaves as soon
+	 * as it has everything: only a stripe knows that its transfer failed when the EOT goes unanswered */
+	bool sent = acknowledged || !stripe.stripes;
+	if(!sent){
+		ERROR("The EOT of stripe %u was never acknowledged\n", stripe.stripe);
+	}
 
 	send_statistics(stats_filename);
 
+	slot_pool_destroy(&pool);
+	if(compressing){
+		deflateEnd(&compressor.stream);
+	}
+	if(input.map != NULL){
+		munmap((void*) input.map, input.map_size);
+	}
 	close(fd);
 	close(sfd);
 
-	return EXIT_SUCCESS;
+	return sent ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 
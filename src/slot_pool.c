@@ -0,0 +1,58 @@
+#include "slot_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "config.h"
+
+int slot_pool_init(slot_pool_t *pool, size_t count, size_t slot_size){
+	memset(pool, 0, sizeof(slot_pool_t));
+	pool->slot_size = (slot_size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+	pool->count = count;
+
+	if(posix_memalign((void**) &pool->arena, CACHE_LINE_SIZE, count * pool->slot_size)){
+		ERROR("Could not allocate the slot arena");
+		pool->arena = NULL;
+		return -1;
+	}
+	pool->slots = (slot_t*) calloc(count, sizeof(slot_t));
+	pool->free_slots = (slot_t**) malloc(count * sizeof(slot_t*));
+	if(pool->slots == NULL || pool->free_slots == NULL){
+		ERROR("Could not allocate the slot descriptors");
+		slot_pool_destroy(pool);
+		return -1;
+	}
+
+	/* Push in reverse order so that slots are handed out from the start of the arena */
+	for(size_t i = 0; i < count; i++){
+		slot_t *slot = &pool->slots[count - 1 - i];
+		slot->data = pool->arena + (count - 1 - i) * pool->slot_size;
+		pool->free_slots[i] = slot;
+	}
+	pool->n_free = count;
+	return 0;
+}
+
+void slot_pool_destroy(slot_pool_t *pool){
+	free(pool->arena);
+	free(pool->slots);
+	free(pool->free_slots);
+	memset(pool, 0, sizeof(slot_pool_t));
+}
+
+slot_t* slot_get(slot_pool_t *pool){
+	if(!pool->n_free) return NULL;
+	slot_t *slot = pool->free_slots[--pool->n_free];
+	memset(&slot->pkt, 0, sizeof(pkt_t));
+	slot->frame_len = 0;
+	slot->transmissions = 0;
+	slot->sacked = false;
+	slot->missed = false;
+	tw_timer_init(&slot->timer);
+	return slot;
+}
+
+void slot_put(slot_pool_t *pool, slot_t *slot){
+	pool->free_slots[pool->n_free++] = slot;
+}
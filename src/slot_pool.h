@@ -0,0 +1,61 @@
+#ifndef __SLOT_POOL_H_
+#define __SLOT_POOL_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "packet.h"
+#include "timer_wheel.h"
+
+/* One packet of a sending or receiving window.
+ * @pkt: header fields of the packet, pkt.payload points inside data
+ *       and must never be released with pkt_del()
+ * @data: slot_size bytes inside the pool arena, aligned on a cache line
+ * @frame_len: number of encoded bytes currently stored in data
+ * @transmissions: number of times the packet was sent
+ * @sacked: the receiver reported holding the packet in a selective acknowledgement
+ * @missed: a selective acknowledgement reported the packet missing
+ * @timer: retransmission timer of the packet, must be cancelled before the slot is put back
+ */
+typedef struct slot {
+	pkt_t pkt;
+	char *data;
+	size_t frame_len;
+	unsigned int transmissions;
+	bool sacked;
+	bool missed;
+	tw_timer_t timer;
+} slot_t;
+
+/* Fixed set of slots carved out of a single contiguous arena.
+ * All the memory is allocated once by slot_pool_init(), so getting and
+ * putting back slots never touches the heap.
+ */
+typedef struct slot_pool {
+	char *arena;
+	slot_t *slots;
+	slot_t **free_slots; /* Stack of the slots that are not in use */
+	size_t n_free;
+	size_t count;
+	size_t slot_size;
+} slot_pool_t;
+
+/* Allocate the arena and the bookkeeping of a pool
+ * @count: the number of slots
+ * @slot_size: the minimal size of a slot, rounded up to a cache line
+ * @return: 0 in case of success, -1 otherwise
+ */
+int slot_pool_init(slot_pool_t *pool, size_t count, size_t slot_size);
+
+/* Release all the memory owned by the pool, slots included */
+void slot_pool_destroy(slot_pool_t *pool);
+
+/* Take a free slot out of the pool
+ * @return: NULL if all the slots are in use
+ */
+slot_t* slot_get(slot_pool_t *pool);
+
+/* Give a slot back to the pool it was taken from */
+void slot_put(slot_pool_t *pool, slot_t *slot);
+
+#endif // __SLOT_POOL_H_
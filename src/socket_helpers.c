@@ -1,5 +1,7 @@
 #include "socket_helpers.h"
 
+unsigned long io_syscalls = 0;
+
 const char * real_address(const char *address, struct sockaddr_in6 *rval){
 	struct addrinfo *result;
 	struct addrinfo hints;
@@ -69,3 +71,110 @@ int wait_for_client(int sfd){
 	return 0;
 }
 
+
+
+int send_batch_queue(const int sfd, send_batch_t *batch, const void *buf, size_t len){
+	struct iovec iov = {.iov_base = (void*) buf, .iov_len = len};
+	return send_batch_queuev(sfd, batch, &iov, 1);
+}
+
+int send_batch_queue_to(const int sfd, send_batch_t *batch, const void *buf, size_t len, const struct sockaddr_in6 *dest){
+	batch->dests[batch->count] = *dest;
+	batch->named[batch->count] = 1;
+	struct iovec iov = {.iov_base = (void*) buf, .iov_len = len};
+	batch->iovs[batch->count][0] = iov;
+	batch->iovcnt[batch->count] = 1;
+	batch->count++;
+	if(batch->count == BATCH_SIZE && send_batch_flush(sfd, batch) == -1){
+		return -1;
+	}
+	return 0;
+}
+
+int send_batch_queuev(const int sfd, send_batch_t *batch, const struct iovec *iov, int iovcnt){
+	memcpy(batch->iovs[batch->count], iov, iovcnt * sizeof(struct iovec));
+	batch->iovcnt[batch->count] = iovcnt;
+	batch->named[batch->count] = 0;
+	batch->count++;
+	if(batch->count == BATCH_SIZE && send_batch_flush(sfd, batch) == -1){
+		return -1;
+	}
+	return 0;
+}
+
+int send_batch_flush(const int sfd, send_batch_t *batch){
+	unsigned int sent = 0;
+	unsigned int failed = 0;
+	while(sent < batch->count){
+		unsigned int i = sent;
+		for(; i < batch->count; i++){
+			memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			batch->msgs[i].msg_hdr.msg_iov = batch->iovs[i];
+			batch->msgs[i].msg_hdr.msg_iovlen = batch->iovcnt[i];
+			if(batch->named[i]){
+				batch->msgs[i].msg_hdr.msg_name = &batch->dests[i];
+				batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+			}
+		}
+		count_syscall();
+		int ret = sendmmsg(sfd, batch->msgs + sent, batch->count - sent, 0);
+		if(ret == -1){
+			if(errno == EINTR) continue;
+			/* Like a lost datagram: drop the one that failed and go on with the others */
+			fprintf(stderr, "could not send datagram: %s\n", strerror(errno));
+			failed++;
+			ret = 1;
+		}
+		sent += ret;
+	}
+	batch->count = 0;
+	return failed ? -1 : (int) sent;
+}
+
+int recv_batch(const int sfd, recv_batch_t *batch, char *const bufs[], size_t buf_len, unsigned int n, int flags){
+	for(unsigned int i = 0; i < n; i++){
+		batch->iovs[i].iov_base = bufs[i];
+		batch->iovs[i].iov_len = buf_len;
+		memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->srcs[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+	}
+	count_syscall();
+	int ret = recvmmsg(sfd, batch->msgs, n, flags, NULL);
+	if(ret == -1){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+		fprintf(stderr, "could not receive datagrams: %s\n", strerror(errno));
+	}
+	return ret;
+}
+
+int set_socket_buffers(const int sfd, int size){
+	if(setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1 ||
+	   setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1){
+		perror("Could not resize the socket buffers");
+	}
+	int granted;
+	socklen_t len = sizeof(granted);
+	if(getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &granted, &len) == -1){
+		return size;
+	}
+	return granted;
+}
+
+int path_mtu(const int sfd){
+	int mtu;
+	socklen_t len = sizeof(mtu);
+	if(getsockopt(sfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == -1){
+		return -1;
+	}
+	return mtu;
+}
+
+void set_dont_fragment(const int sfd, int probe){
+	int mode = probe ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+	if(setsockopt(sfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode)) == -1){
+		perror("Could not set IPV6_MTU_DISCOVER");
+	}
+}
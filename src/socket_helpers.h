@@ -19,6 +19,38 @@
 /* netinet/ */
 #include <netinet/in.h>
 
+#include "config.h"
+
+/* I/O system calls made so far by the transfer loops, from any thread, reported in the statistics */
+extern unsigned long io_syscalls;
+
+static inline void count_syscall(void){
+	__atomic_fetch_add(&io_syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* Maximum number of pieces gathered in one queued datagram */
+#define SEND_BATCH_MAX_IOV 3
+
+/* Outgoing datagrams waiting to be sent with a single sendmmsg().
+ * The queued buffers are not copied: they must stay untouched until
+ * the next flush. The destination addresses are copied.
+ */
+typedef struct send_batch {
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE][SEND_BATCH_MAX_IOV];
+	int iovcnt[BATCH_SIZE];
+	struct sockaddr_in6 dests[BATCH_SIZE];
+	int named[BATCH_SIZE]; /* dests[i] is set, otherwise the socket is connected */
+	unsigned int count;
+} send_batch_t;
+
+/* Incoming datagrams received with a single recvmmsg(), along with their source addresses */
+typedef struct recv_batch {
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	struct sockaddr_in6 srcs[BATCH_SIZE];
+} recv_batch_t;
+
 /* Resolve the resource name to an usable IPv6 address
  * @address: The name to resolve
  * @rval: Where the resulting IPv6 address descriptor should be stored
@@ -59,4 +91,53 @@ int wait_for_client(int sfd);
  */
 void read_write_loop(const int sfd);
 
+/* Queue a datagram on a connected socket, the batch is flushed when full
+ * @return: 0 in case of success, -1 if a flush failed
+ */
+int send_batch_queue(const int sfd, send_batch_t *batch, const void *buf, size_t len);
+
+/* Queue a datagram for dest on a socket that is not connected, the batch is flushed when full
+ * @return: 0 in case of success, -1 if a flush failed
+ */
+int send_batch_queue_to(const int sfd, send_batch_t *batch, const void *buf, size_t len, const struct sockaddr_in6 *dest);
+
+/* Queue a datagram gathered from up to SEND_BATCH_MAX_IOV pieces of memory,
+ * which are not copied either
+ * @return: 0 in case of success, -1 if a flush failed
+ */
+int send_batch_queuev(const int sfd, send_batch_t *batch, const struct iovec *iov, int iovcnt);
+
+/* Send all the queued datagrams
+ * @return: the number of datagrams sent, or -1 in case of error
+ *          (explanation will be printed on stderr). The batch is empty afterwards.
+ */
+int send_batch_flush(const int sfd, send_batch_t *batch);
+
+/* Receive up to n datagrams (n <= BATCH_SIZE) from a socket
+ * @bufs: n buffers of buf_len bytes, bufs[i] receives the i-th datagram
+ * @flags: recvmmsg() flags, MSG_WAITFORONE blocks until one datagram is available,
+ *         MSG_DONTWAIT never blocks
+ * @return: the number of datagrams received, their sizes are in batch->msgs[i].msg_len
+ *          and their sources in batch->srcs[i], or -1 in case of error (0 if nothing was available with MSG_DONTWAIT)
+ */
+int recv_batch(const int sfd, recv_batch_t *batch, char *const bufs[], size_t buf_len, unsigned int n, int flags);
+
+/* Ask for send and receive buffers of size bytes, the kernel may cap them (net.core.[rw]mem_max)
+ * @return: the size of the receive buffer granted, as accounted by the kernel (twice the
+ *          payload it can hold for large datagrams, less for small ones)
+ */
+int set_socket_buffers(const int sfd, int size);
+
+/* Path MTU towards the peer of a connected socket as known by the kernel
+ * @return: the MTU in bytes, or -1 if it is unknown
+ */
+int path_mtu(const int sfd);
+
+/* Send the datagrams with the don't fragment bit set, to probe the path, or go back to the default
+ * @probe: if non-zero, datagrams are never fragmented and those larger than the known path MTU are
+ *         still sent so that the path can be probed. Otherwise the socket is back to IPV6_PMTUDISC_WANT:
+ *         datagrams larger than the path MTU, which may drop during a transfer, are fragmented
+ */
+void set_dont_fragment(const int sfd, int probe);
+
 #endif
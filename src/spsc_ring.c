@@ -0,0 +1,24 @@
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+int spsc_init(spsc_ring_t *ring, size_t capacity){
+	memset(ring, 0, sizeof(spsc_ring_t));
+	size_t size = 1;
+	while(size < capacity) size <<= 1;
+	ring->items = (void**) malloc(size * sizeof(void*));
+	if(ring->items == NULL){
+		ERROR("Could not allocate a ring of %lu items", (unsigned long) size);
+		return -1;
+	}
+	ring->mask = size - 1;
+	return 0;
+}
+
+void spsc_destroy(spsc_ring_t *ring){
+	free(ring->items);
+	ring->items = NULL;
+}
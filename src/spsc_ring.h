@@ -0,0 +1,83 @@
+#ifndef __SPSC_RING_H_
+#define __SPSC_RING_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+/* Lock-free ring of pointers between exactly one producer thread and one consumer thread.
+ * head and tail count the items popped and pushed since the start, they only wrap with size_t.
+ * Each side keeps its own index and a cached copy of the other one on its own cache line, so
+ * that the shared index is only read again when the ring looks full (or empty).
+ * @items: capacity slots, capacity is a power of two
+ * @mask: capacity - 1
+ */
+typedef struct spsc_ring {
+	void **items;
+	size_t mask;
+	/* Consumer side */
+	size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t cached_tail;
+	/* Producer side */
+	size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t cached_head;
+} spsc_ring_t;
+
+/* Allocate an empty ring
+ * @capacity: maximum number of items, rounded up to a power of two
+ * @return: 0 in case of success, -1 otherwise
+ */
+int spsc_init(spsc_ring_t *ring, size_t capacity);
+
+/* Release the memory of the ring, the items are not touched */
+void spsc_destroy(spsc_ring_t *ring);
+
+/* Producer: add an item, the writes made before are visible to the consumer once it pops it
+ * @return: false if the ring is full
+ */
+static inline bool spsc_push(spsc_ring_t *ring, void *item){
+	size_t tail = ring->tail;
+	if(tail - ring->cached_head > ring->mask){
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(tail - ring->cached_head > ring->mask) return false;
+	}
+	ring->items[tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Consumer: take the oldest item
+ * @return: NULL if the ring is empty
+ */
+static inline void* spsc_pop(spsc_ring_t *ring){
+	size_t head = ring->head;
+	if(head == ring->cached_tail){
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(head == ring->cached_tail) return NULL;
+	}
+	void *item = ring->items[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+/* Consumer: whether there is nothing to pop */
+static inline bool spsc_empty(spsc_ring_t *ring){
+	if(ring->head != ring->cached_tail) return false;
+	ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return ring->head == ring->cached_tail;
+}
+
+/* Either side: number of items in the ring, already outdated when the other side is running */
+static inline size_t spsc_size(const spsc_ring_t *ring){
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/* Producer: whether a push would fail */
+static inline bool spsc_full(spsc_ring_t *ring){
+	if(ring->tail - ring->cached_head <= ring->mask) return false;
+	ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	return ring->tail - ring->cached_head > ring->mask;
+}
+
+#endif // __SPSC_RING_H_
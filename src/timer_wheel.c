@@ -0,0 +1,164 @@
+#include "timer_wheel.h"
+
+static void tw_unlink(tw_timer_t *timer){
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+static void tw_link(tw_timer_t *head, tw_timer_t *timer){
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/* Put a timer in the bucket of tick, which is less than one rotation ahead */
+static void tw_link_bucket(timer_wheel_t *wheel, uint64_t tick, tw_timer_t *timer){
+	size_t bucket = tick % TW_BUCKETS;
+	tw_link(&wheel->buckets[bucket], timer);
+	wheel->used[bucket / 64] |= (uint64_t) 1 << (bucket % 64);
+}
+
+/* Clear the bit of a list left empty, if it is a bucket and not the overflow */
+static void tw_release(timer_wheel_t *wheel, const tw_timer_t *head){
+	if(head->next != head) return;
+	uintptr_t offset = (uintptr_t) head - (uintptr_t) wheel->buckets;
+	if(offset >= sizeof(wheel->buckets)) return;
+	size_t bucket = offset / sizeof(tw_timer_t);
+	wheel->used[bucket / 64] &= ~((uint64_t) 1 << (bucket % 64));
+}
+
+/* Move the timers of the overflow due within one rotation of last into their bucket */
+static void tw_cascade(timer_wheel_t *wheel, uint64_t last){
+	uint64_t first = UINT64_MAX;
+	tw_timer_t *head = &wheel->overflow;
+	tw_timer_t *timer = head->next;
+	while(timer != head){
+		tw_timer_t *next = timer->next;
+		uint64_t tick = timer->expiry / TW_RESOLUTION;
+		if(tick < last + TW_BUCKETS){
+			tw_unlink(timer);
+			tw_link_bucket(wheel, tick < last ? last : tick, timer);
+		} else if(tick < first){
+			first = tick;
+		}
+		timer = next;
+	}
+	// Walking the overflow again before half a rotation would be wasted
+	wheel->cascade = UINT64_MAX;
+	if(first != UINT64_MAX){
+		wheel->cascade = first - TW_BUCKETS + 1;
+		if(wheel->cascade < last + TW_BUCKETS / 2) wheel->cascade = last + TW_BUCKETS / 2;
+	}
+}
+
+void tw_init(timer_wheel_t *wheel, uint64_t now){
+	for(int i = 0; i < TW_BUCKETS; i++){
+		wheel->buckets[i].next = wheel->buckets[i].prev = &wheel->buckets[i];
+	}
+	wheel->overflow.next = wheel->overflow.prev = &wheel->overflow;
+	for(int i = 0; i < TW_WORDS; i++){
+		wheel->used[i] = 0;
+	}
+	wheel->tick = now / TW_RESOLUTION;
+	wheel->cascade = UINT64_MAX;
+	wheel->count = 0;
+}
+
+void tw_timer_init(tw_timer_t *timer){
+	timer->next = timer->prev = NULL;
+	timer->expiry = 0;
+}
+
+int tw_is_armed(const tw_timer_t *timer){
+	return timer->next != NULL;
+}
+
+void tw_schedule(timer_wheel_t *wheel, tw_timer_t *timer, uint64_t expiry){
+	tw_cancel(wheel, timer);
+	timer->expiry = expiry;
+	uint64_t tick = expiry / TW_RESOLUTION;
+	// A deadline already in the past goes in the next bucket to be processed
+	if(tick < wheel->tick) tick = wheel->tick;
+	if(tick < wheel->tick + TW_BUCKETS){
+		tw_link_bucket(wheel, tick, timer);
+	} else {
+		tw_link(&wheel->overflow, timer);
+		// The cascade must happen before the timer is due, but not sooner than half a rotation
+		uint64_t cascade = tick - TW_BUCKETS + 1;
+		if(cascade < wheel->tick + TW_BUCKETS / 2) cascade = wheel->tick + TW_BUCKETS / 2;
+		if(cascade < wheel->cascade) wheel->cascade = cascade;
+	}
+	wheel->count++;
+}
+
+void tw_cancel(timer_wheel_t *wheel, tw_timer_t *timer){
+	if(!tw_is_armed(timer)) return;
+	tw_timer_t *next = timer->next;
+	tw_unlink(timer);
+	tw_release(wheel, next);
+	wheel->count--;
+}
+
+int tw_advance(timer_wheel_t *wheel, uint64_t now, tw_callback_t callback, void *arg){
+	uint64_t last = now / TW_RESOLUTION;
+	int fired = 0;
+	tw_timer_t expired;
+	expired.next = expired.prev = &expired;
+
+	if(last >= wheel->cascade) tw_cascade(wheel, last);
+
+	// Visiting more than one rotation would go through the same buckets again
+	uint64_t first = wheel->tick;
+	if(last >= first + TW_BUCKETS) first = last - TW_BUCKETS + 1;
+
+	for(uint64_t tick = first; tick <= last && wheel->count; tick++){
+		tw_timer_t *head = &wheel->buckets[tick % TW_BUCKETS];
+		tw_timer_t *timer = head->next;
+		while(timer != head){
+			tw_timer_t *next = timer->next;
+			if(timer->expiry <= now){
+				tw_unlink(timer);
+				wheel->count--;
+				tw_link(&expired, timer);
+			}
+			timer = next;
+		}
+		tw_release(wheel, head);
+	}
+	// The last bucket may still hold timers due later in the same tick
+	wheel->tick = last;
+
+	// Callbacks run once the wheel is consistent, they may schedule timers again
+	while(expired.next != &expired){
+		tw_timer_t *timer = expired.next;
+		tw_unlink(timer);
+		callback(timer, arg);
+		fired++;
+	}
+	return fired;
+}
+
+uint64_t tw_next_expiry(const timer_wheel_t *wheel){
+	uint64_t best = UINT64_MAX;
+	if(!wheel->count) return best;
+	if(wheel->overflow.next != &wheel->overflow) best = wheel->cascade * TW_RESOLUTION;
+
+	// First non-empty bucket from the current one, the word of the current one is seen twice:
+	// first for the buckets after it, last for the ones before it
+	size_t start = wheel->tick % TW_BUCKETS;
+	for(size_t i = 0; i <= TW_WORDS; i++){
+		size_t word = (start / 64 + i) % TW_WORDS;
+		uint64_t bits = wheel->used[word];
+		if(i == 0) bits &= ~(uint64_t) 0 << (start % 64);
+		if(i == TW_WORDS) bits &= ((uint64_t) 1 << (start % 64)) - 1;
+		if(bits){
+			size_t bucket = word * 64 + __builtin_ctzll(bits);
+			uint64_t tick = wheel->tick + (bucket + TW_BUCKETS - start) % TW_BUCKETS;
+			uint64_t end = (tick + 1) * TW_RESOLUTION;
+			return end < best ? end : best;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,66 @@
+#ifndef __TIMER_WHEEL_H_
+#define __TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of buckets of the wheel and time covered by each one (in us).
+ * Timers further away than one rotation wait in an overflow list, which is
+ * moved into the buckets at most every half rotation.
+ * TW_BUCKETS must be a multiple of 64, see timer_wheel_t.used.
+ */
+#define TW_BUCKETS 512
+#define TW_RESOLUTION 1000
+#define TW_WORDS (TW_BUCKETS / 64)
+
+/* Timer embedded in the structure it belongs to, see TW_ENTRY() */
+typedef struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer *prev;
+	uint64_t expiry; /* Absolute deadline, in us of clock_us() */
+} tw_timer_t;
+
+/* Retrieve the structure of type `type` embedding the timer in its field `member` */
+#define TW_ENTRY(timer, type, member) ((type*) ((char*) (timer) - offsetof(type, member)))
+
+/* Called for each expired timer. The timer is no longer armed and may be scheduled again. */
+typedef void (*tw_callback_t)(tw_timer_t *timer, void *arg);
+
+/* Hashed timer wheel: scheduling, cancelling and expiring a timer are O(1) */
+typedef struct timer_wheel {
+	tw_timer_t buckets[TW_BUCKETS]; /* Sentinels of circular lists */
+	tw_timer_t overflow;            /* Timers due one rotation or more after tick */
+	uint64_t used[TW_WORDS];        /* Bitmap of the non-empty buckets */
+	uint64_t tick;                  /* Next tick to be processed */
+	uint64_t cascade;               /* Tick at which the overflow is moved into the buckets */
+	size_t count;                   /* Number of armed timers */
+} timer_wheel_t;
+
+/* Initialize an empty wheel starting at the time now */
+void tw_init(timer_wheel_t *wheel, uint64_t now);
+
+/* Initialize a timer that is not armed */
+void tw_timer_init(tw_timer_t *timer);
+
+/* Returns whether the timer is armed */
+int tw_is_armed(const tw_timer_t *timer);
+
+/* Arm a timer to expire at the time expiry, it is first cancelled if already armed */
+void tw_schedule(timer_wheel_t *wheel, tw_timer_t *timer, uint64_t expiry);
+
+/* Disarm a timer, nothing happens if it is not armed */
+void tw_cancel(timer_wheel_t *wheel, tw_timer_t *timer);
+
+/* Fire all the timers whose deadline is not after now
+ * @return: the number of timers fired
+ */
+int tw_advance(timer_wheel_t *wheel, uint64_t now, tw_callback_t callback, void *arg);
+
+/* Returns a time at which tw_advance() has timers to fire or to move out of the
+ * overflow, or UINT64_MAX if none is armed. This is the end of the tick of the
+ * earliest timer, so a timer fires up to TW_RESOLUTION late. O(1): it only looks
+ * at the bitmap of the buckets, never at the timers.
+ */
+uint64_t tw_next_expiry(const timer_wheel_t *wheel);
+
+#endif // __TIMER_WHEEL_H_
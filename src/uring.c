@@ -0,0 +1,345 @@
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+/* user_data of a CQE already taken by uring_wait_for(), and of the writes of uring_writev() */
+#define URING_CLAIMED UINT64_MAX
+#define URING_WRITE (URING_INTERNAL | (1ULL << 62))
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p){
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz){
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args){
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *ring, unsigned int entries, unsigned int cq_entries, size_t send_size){
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+	struct io_uring_params p;
+	/* The completions are only run when the thread enters the ring, which it does whenever it waits.
+	 * Older kernels do not know these flags */
+	unsigned int flags[] = {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, 0};
+	for(size_t i = 0; i < sizeof(flags) / sizeof(flags[0]) && ring->fd == -1; i++){
+		memset(&p, 0, sizeof(p));
+		p.flags = flags[i] | IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+		ring->fd = sys_io_uring_setup(entries, &p);
+		if(ring->fd == -1 && errno != EINVAL) return -1;
+	}
+	if(ring->fd == -1) return -1;
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)){
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	ring->flags = p.flags;
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP && ring->cq_map_size > ring->sq_map_size){
+		ring->sq_map_size = ring->cq_map_size;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_map == MAP_FAILED){
+		ring->sq_map = NULL;
+		uring_exit(ring);
+		return -1;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_map == MAP_FAILED){
+			ring->cq_map = NULL;
+			uring_exit(ring);
+			return -1;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED){
+		ring->sqes = NULL;
+		uring_exit(ring);
+		return -1;
+	}
+
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_head = (unsigned int*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int*) (sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int*) (sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+	/* The SQEs are always submitted in order, entry i of the array is SQE i for good */
+	unsigned int *array = (unsigned int*) (sq + p.sq_off.array);
+	for(unsigned int i = 0; i < p.sq_entries; i++){
+		array[i] = i;
+	}
+	ring->cq_head = (unsigned int*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*) (cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	if(send_size){
+		ring->send_count = p.sq_entries;
+		ring->send_size = send_size;
+		ring->sends = (uring_send_t*) calloc(ring->send_count, sizeof(uring_send_t));
+		ring->send_data = (char*) malloc(ring->send_count * send_size);
+		ring->free_sends = (unsigned int*) malloc(ring->send_count * sizeof(unsigned int));
+		if(ring->sends == NULL || ring->send_data == NULL || ring->free_sends == NULL){
+			ERROR("Could not allocate the datagrams of the ring");
+			uring_exit(ring);
+			return -1;
+		}
+		for(unsigned int i = 0; i < ring->send_count; i++){
+			ring->sends[i].data = ring->send_data + i * send_size;
+			ring->free_sends[i] = i;
+		}
+		ring->n_free_sends = ring->send_count;
+	}
+	return 0;
+}
+
+void uring_exit(uring_t *ring){
+	if(ring->bufs != NULL) munmap(ring->bufs, ring->bufs_size);
+	if(ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+	if(ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_size);
+	if(ring->fd != -1) close(ring->fd);
+	free(ring->sends);
+	free(ring->send_data);
+	free(ring->free_sends);
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+}
+
+int uring_enter(uring_t *ring, unsigned int wait_nr, int64_t timeout){
+	unsigned int to_submit = uring_pending(ring);
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned int flags = wait_nr || ring->flags & IORING_SETUP_DEFER_TASKRUN ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts = {.tv_sec = timeout / 1000000, .tv_nsec = (timeout % 1000000) * 1000};
+	struct io_uring_getevents_arg arg = {.ts = (uint64_t) (uintptr_t) &ts};
+	if(timeout >= 0 && wait_nr){
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	while(1){
+		count_syscall();
+		int ret = flags & IORING_ENTER_EXT_ARG ? sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg))
+		                                       : sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+		if(ret >= 0) return ret;
+		if(errno == ETIME) return 0;
+		/* The SQEs were taken before the signal, only the wait remains */
+		if(errno == EINTR){
+			to_submit = 0;
+			continue;
+		}
+		ERROR("io_uring_enter() failed: %s", strerror(errno));
+		return -1;
+	}
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t *ring){
+	if(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries){
+		uring_enter(ring, 0, -1);
+		if(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+	}
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqe_tail++;
+	return sqe;
+}
+
+/* Handle a CQE of the ring itself: the datagram of a send is free again */
+static void uring_internal_cqe(uring_t *ring, struct io_uring_cqe *cqe){
+	if(cqe->user_data == URING_CLAIMED || cqe->user_data == URING_WRITE) return;
+	if(cqe->res < 0){
+		fprintf(stderr, "could not send datagram: %s\n", strerror(-cqe->res));
+	}
+	ring->free_sends[ring->n_free_sends++] = (unsigned int) (cqe->user_data & ~URING_INTERNAL);
+	cqe->user_data = URING_CLAIMED;
+}
+
+struct io_uring_cqe* uring_next_cqe(uring_t *ring){
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while(*ring->cq_head != tail){
+		struct io_uring_cqe *cqe = &ring->cqes[*ring->cq_head & ring->cq_mask];
+		if(!(cqe->user_data & URING_INTERNAL)) return cqe;
+		uring_internal_cqe(ring, cqe);
+		uring_cqe_seen(ring);
+	}
+	return NULL;
+}
+
+int uring_wait_for(uring_t *ring, uint64_t user_data){
+	while(1){
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for(unsigned int i = head; i != tail; i++){
+			struct io_uring_cqe *cqe = &ring->cqes[i & ring->cq_mask];
+			if(cqe->user_data != user_data) continue;
+			int res = cqe->res;
+			cqe->user_data = URING_CLAIMED;
+			if(i == head) uring_next_cqe(ring);
+			return res;
+		}
+		/* Requests submitted along usually complete right away, the wait covers them too */
+		unsigned int pending = uring_pending(ring);
+		unsigned int extra = ring->wait_extra;
+		ring->wait_extra = 0;
+		if(uring_enter(ring, tail - head + (pending ? pending : 1) + extra, extra ? ring->wait_timeout : -1) == -1) return -errno;
+	}
+}
+
+int uring_buf_ring_init(uring_t *ring, unsigned int count, uint16_t group){
+	ring->bufs_size = count * sizeof(struct io_uring_buf);
+	ring->bufs = mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring->bufs == MAP_FAILED){
+		ring->bufs = NULL;
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->bufs;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if(sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+		munmap(ring->bufs, ring->bufs_size);
+		ring->bufs = NULL;
+		return -1;
+	}
+	ring->buf_mask = count - 1;
+	ring->buf_tail = 0;
+	return 0;
+}
+
+int uring_register_buffer(uring_t *ring, void *addr, size_t len){
+	struct iovec iov = {.iov_base = addr, .iov_len = len};
+	return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1 ? -1 : 0;
+}
+
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int sfd, struct msghdr *msg, uint16_t group){
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sfd;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+}
+
+char* uring_recvmsg_payload(char *buf, int res, const struct msghdr *msg, struct sockaddr_in6 *src, size_t *len){
+	/* The buffer starts with a header, then come the name and the control data, at their full length */
+	struct io_uring_recvmsg_out out;
+	size_t offset = sizeof(out) + msg->msg_namelen + msg->msg_controllen;
+	if(res < (int) offset) return NULL;
+	memcpy(&out, buf, sizeof(out));
+	if(out.flags & MSG_TRUNC || out.payloadlen > res - offset) return NULL;
+	memset(src, 0, sizeof(struct sockaddr_in6));
+	memcpy(src, buf + sizeof(out), out.namelen < sizeof(struct sockaddr_in6) ? out.namelen : sizeof(struct sockaddr_in6));
+	*len = out.payloadlen;
+	return buf + offset;
+}
+
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *addr, unsigned int len, int64_t offset, uint64_t user_data){
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) addr;
+	sqe->len = len;
+	sqe->off = (uint64_t) offset;
+	sqe->user_data = user_data;
+}
+
+ssize_t uring_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt, int64_t offset){
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if(sqe == NULL){
+		errno = EBUSY;
+		return -1;
+	}
+	uring_prep_rw(sqe, IORING_OP_WRITEV, fd, (void*) iov, iovcnt, offset, URING_WRITE);
+	int res = uring_wait_for(ring, URING_WRITE);
+	if(res < 0){
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/* Wait until at least n datagrams are free, the CQEs of the caller stay in the queue
+ * @return: 0 in case of success, -1 otherwise
+ */
+static int uring_reap_sends(uring_t *ring, unsigned int n){
+	while(ring->n_free_sends < n){
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for(unsigned int i = head; i != tail; i++){
+			struct io_uring_cqe *cqe = &ring->cqes[i & ring->cq_mask];
+			if(cqe->user_data & URING_INTERNAL) uring_internal_cqe(ring, cqe);
+		}
+		if(ring->n_free_sends < n && uring_enter(ring, tail - head + 1, -1) == -1) return -1;
+	}
+	return 0;
+}
+
+int uring_flush(uring_t *ring){
+	if(uring_pending(ring) && uring_enter(ring, 0, -1) == -1) return -1;
+	return uring_reap_sends(ring, ring->send_count);
+}
+
+int uring_send_batch(uring_t *ring, const int sfd, send_batch_t *batch){
+	int dropped = 0;
+	for(unsigned int i = 0; i < batch->count; i++){
+		/* All the datagrams are in flight: the oldest ones are surely gone once submitted */
+		if(uring_reap_sends(ring, 1)) return -1;
+		size_t len = 0;
+		for(int k = 0; k < batch->iovcnt[i]; k++){
+			len += batch->iovs[i][k].iov_len;
+		}
+		if(len > ring->send_size){
+			fprintf(stderr, "could not send datagram: %lu bytes is too large for the ring\n", (unsigned long) len);
+			dropped++;
+			continue;
+		}
+		struct io_uring_sqe *sqe = uring_get_sqe(ring);
+		if(sqe == NULL){
+			dropped++;
+			continue;
+		}
+		unsigned int idx = ring->free_sends[--ring->n_free_sends];
+		uring_send_t *send = &ring->sends[idx];
+		len = 0;
+		for(int k = 0; k < batch->iovcnt[i]; k++){
+			memcpy(send->data + len, batch->iovs[i][k].iov_base, batch->iovs[i][k].iov_len);
+			len += batch->iovs[i][k].iov_len;
+		}
+		memset(&send->msg, 0, sizeof(struct msghdr));
+		send->iov.iov_base = send->data;
+		send->iov.iov_len = len;
+		send->msg.msg_iov = &send->iov;
+		send->msg.msg_iovlen = 1;
+		if(batch->named[i]){
+			send->dest = batch->dests[i];
+			send->msg.msg_name = &send->dest;
+			send->msg.msg_namelen = sizeof(struct sockaddr_in6);
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sfd;
+		sqe->addr = (uint64_t) (uintptr_t) &send->msg;
+		sqe->len = 1;
+		sqe->user_data = URING_INTERNAL | idx;
+	}
+	batch->count = 0;
+	return dropped ? -1 : 0;
+}
@@ -0,0 +1,179 @@
+#ifndef __URING_H_
+#define __URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "socket_helpers.h"
+
+/* user_data values with this bit set belong to the ring itself, see uring_next_cqe() */
+#define URING_INTERNAL (1ULL << 63)
+
+/* Datagram handed to the ring by uring_send_batch(), kept until the kernel is done with it */
+typedef struct uring_send {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in6 dest;
+	char *data;
+} uring_send_t;
+
+/* io_uring instance driven with the raw system calls, liburing is not needed.
+ * The submission and completion queues are shared with the kernel, only the thread that
+ * created the ring may use it.
+ * @sqe_tail: SQEs handed out so far, the kernel sees them at the next uring_enter()
+ * @bufs: ring of buffers the kernel picks from to receive (see uring_buf_ring_init()), NULL if none
+ * @sends: send_count datagrams of up to send_size bytes, free_sends lists the n_free_sends available
+ * @wait_extra: CQEs the next uring_wait_for() also waits for, up to wait_timeout, see uring_wait_also()
+ */
+typedef struct uring {
+	int fd;
+	unsigned int flags;
+	/* Submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;
+	/* Completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	/* Provided buffers */
+	struct io_uring_buf_ring *bufs;
+	unsigned int buf_mask;
+	uint16_t buf_tail;
+	size_t bufs_size;
+	/* Datagrams being sent */
+	uring_send_t *sends;
+	char *send_data;
+	size_t send_size;
+	unsigned int send_count;
+	unsigned int *free_sends;
+	unsigned int n_free_sends;
+	unsigned int wait_extra;
+	int64_t wait_timeout;
+} uring_t;
+
+/* Set up a ring
+ * @entries: size of the submission queue, the completion queue is cq_entries long
+ * @send_size: largest datagram uring_send_batch() takes, 0 if the ring does not send any
+ * @return: 0 in case of success, -1 if io_uring is not available (errno tells why)
+ */
+int uring_init(uring_t *ring, unsigned int entries, unsigned int cq_entries, size_t send_size);
+
+/* Release the ring, the requests still in flight are cancelled by the kernel */
+void uring_exit(uring_t *ring);
+
+/* Take a blank SQE, the queue is submitted first if it is full
+ * @return: NULL if the queue is still full
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t *ring);
+
+/* Submit the SQEs taken so far and wait until the completion queue holds wait_nr CQEs
+ * @timeout: in microseconds, negative to wait as long as needed
+ * @return: the number of SQEs submitted, or -1 in case of error. Running out of time is not an error.
+ */
+int uring_enter(uring_t *ring, unsigned int wait_nr, int64_t timeout);
+
+/* Number of SQEs taken but not submitted yet */
+static inline unsigned int uring_pending(const uring_t *ring){
+	return ring->sqe_tail - *ring->sq_tail;
+}
+
+/* Take the oldest CQE of the caller, the ones of URING_INTERNAL requests are handled on the way.
+ * It must be released with uring_cqe_seen() before the next call.
+ * @return: NULL if there is none yet
+ */
+struct io_uring_cqe* uring_next_cqe(uring_t *ring);
+
+/* Release the CQE returned by uring_next_cqe() */
+static inline void uring_cqe_seen(uring_t *ring){
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit what was queued and wait for the completion of the request tagged user_data, leaving the
+ * other CQEs to uring_next_cqe(). The requests queued before must complete on their own (not a
+ * multishot receive), the first wait lasts until they all did.
+ * @return: the result of the request, a negated errno value if it failed
+ */
+int uring_wait_for(uring_t *ring, uint64_t user_data);
+
+/* Make the first wait of the next uring_wait_for() last until extra more CQEs came, or timeout us
+ * (negative for no limit): a write can then wait for the next datagram in the same system call.
+ * Once the time is over, the request is waited for alone. Set extra to 0 to cancel it.
+ */
+static inline void uring_wait_also(uring_t *ring, unsigned int extra, int64_t timeout){
+	ring->wait_extra = extra;
+	ring->wait_timeout = timeout;
+}
+
+/* Set up the ring of up to count buffers the kernel picks from to receive (IORING_OP_RECVMSG with
+ * IOSQE_BUFFER_SELECT) as group, the buffers are handed over with uring_buf_put()
+ * @count: a power of two
+ * @return: 0 in case of success, -1 otherwise
+ */
+int uring_buf_ring_init(uring_t *ring, unsigned int count, uint16_t group);
+
+/* Hand a buffer over to the kernel, the CQE of the datagram received in it carries its bid */
+static inline void uring_buf_put(uring_t *ring, void *addr, unsigned int len, uint16_t bid){
+	struct io_uring_buf *buf = &ring->bufs->bufs[ring->buf_tail & ring->buf_mask];
+	buf->addr = (uint64_t) (uintptr_t) addr;
+	buf->len = len;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Pin memory once for all, so that the reads into it use IORING_OP_READ_FIXED with buffer 0
+ * @return: 0 in case of success, -1 otherwise (the pages may be more than RLIMIT_MEMLOCK)
+ */
+int uring_register_buffer(uring_t *ring, void *addr, size_t len);
+
+/* Queue a multishot receive of the datagrams of sfd into the buffers of group. Each one comes with
+ * its own CQE until one comes without IORING_CQE_F_MORE, the receive must then be queued again.
+ * @msg: only its msg_namelen and msg_controllen are used, it must stay valid
+ */
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int sfd, struct msghdr *msg, uint16_t group);
+
+/* Find the datagram in a buffer filled by a multishot receive
+ * @res: the result of the CQE
+ * @msg: the msghdr given to uring_prep_recvmsg_multishot()
+ * @src: set to the source address
+ * @return: the start of the datagram, its length is in *len, NULL if it was truncated
+ */
+char* uring_recvmsg_payload(char *buf, int res, const struct msghdr *msg, struct sockaddr_in6 *src, size_t *len);
+
+/* Queue a read (or write) of len bytes at offset, -1 for the current position of the file
+ * @op: IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED
+ */
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *addr, unsigned int len, int64_t offset, uint64_t user_data);
+
+/* Write iovcnt pieces at offset (-1 for the current position) through the ring, along with the
+ * SQEs queued before, and wait for the write
+ * @return: the number of bytes written, or -1 with errno set
+ */
+ssize_t uring_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt, int64_t offset);
+
+/* Queue the datagrams of batch on the ring, they are copied so that the batch is empty afterwards.
+ * They leave at the next uring_enter(), or sooner if the ring runs out of room.
+ * @return: 0 in case of success, -1 if a datagram was dropped
+ */
+int uring_send_batch(uring_t *ring, const int sfd, send_batch_t *batch);
+
+/* Submit what was queued and wait until all the datagrams sent through the ring are gone
+ * @return: 0 in case of success, -1 otherwise
+ */
+int uring_flush(uring_t *ring);
+
+#endif // __URING_H_
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+# Mesure des transferts de bout en bout au travers de link_emu, pour chaque
+# combinaison de perte, de délai et d'options du sender. Les autres défauts du
+# lien sont fixés par l'environnement (JITTER, ERR, CUT, REORDER, RATE, SEED).
+# Affiche pour chaque transfert la durée, le débit utile, la part de paquets
+# retransmis et les percentiles du RTT, au format CSV (aussi dans link_bench/results.csv).
+# Les options données après la taille sont celles du sender, RECEIVER_OPTS celles du receiver.
+# Usage: LOSS="0 5" DELAY="0 20" link_bench.sh taille_du_fichier ["options 1" "options 2"...]
+
+size=${1:-1000000}
+shift
+if [ $# -eq 0 ]; then
+  set -- ""
+fi
+
+LOSS=${LOSS:-"0 2 10"}
+DELAY=${DELAY:-"0 10 50"}
+JITTER=${JITTER:-0}
+ERR=${ERR:-0}
+CUT=${CUT:-0}
+REORDER=${REORDER:-0}
+RATE=${RATE:-0}
+SEED=${SEED:-1}
+# Durée maximale d'un transfert, en secondes
+TIMEOUT=${TIMEOUT:-120}
+
+sender_port=2470
+receiver_port=2471
+
+rm -rf link_bench
+mkdir link_bench
+head -c $size /dev/urandom > link_bench/input_file
+
+# Attend qu'un port UDP soit ouvert, plutôt que de dormir une durée fixe
+wait_port() {
+  local hex=$(printf %04X $1)
+  for i in $(seq 500); do
+    grep -qi ":$hex " /proc/net/udp6 && return 0
+    sleep 0.01
+  done
+  return 1
+}
+
+# Valeur d'une statistique du sender
+stat() {
+  grep "^$1," link_bench/sender.csv | cut -d, -f2
+}
+
+header="loss,delay,jitter,err,cut,reorder,rate,seed,options,seconds,goodput_kBps,retransmission_ratio,rtt_p50_us,rtt_p90_us,rtt_p99_us,ok"
+echo $header | tee link_bench/results.csv
+
+for loss in $LOSS; do
+for delay in $DELAY; do
+for opts in "$@"; do
+  ./link_emu -p $sender_port -P $receiver_port -l $loss -d $delay -j $JITTER -e $ERR \
+             -c $CUT -r $REORDER -b $RATE -s $SEED 2> link_bench/link.log &
+  link_pid=$!
+  ./receiver $RECEIVER_OPTS -s link_bench/receiver.csv :: $receiver_port > link_bench/received_file 2> link_bench/receiver.log &
+  receiver_pid=$!
+  if ! wait_port $sender_port || ! wait_port $receiver_port ; then
+    echo "Le lien ou le receiver n'a pas démarré!"
+    kill -9 $link_pid $receiver_pid 2> /dev/null
+    exit 1
+  fi
+
+  start=$(date +%s%N)
+  timeout $TIMEOUT ./sender $opts -s link_bench/sender.csv ::1 $sender_port < link_bench/input_file 2> link_bench/sender.log
+  end=$(date +%s%N)
+
+  # Le receiver termine peu après le dernier ACK, on ne l'attend pas indéfiniment
+  for i in $(seq 500); do
+    kill -0 $receiver_pid 2> /dev/null || break
+    sleep 0.01
+  done
+  kill -9 $receiver_pid 2> /dev/null
+  wait $receiver_pid 2> /dev/null
+  kill -TERM $link_pid
+  wait $link_pid
+
+  ok=0
+  cmp -s link_bench/input_file link_bench/received_file && ok=1
+  ns=$(( end - start ))
+  seconds=$(awk "BEGIN { printf \"%.3f\", $ns / 1e9 }")
+  goodput=$(awk "BEGIN { printf \"%.1f\", $ok * $size / 1000 / ($ns / 1e9) }")
+  ratio=$(awk "BEGIN { s = $(stat data_sent); printf \"%.3f\", s ? $(stat packets_retransmitted) / s : 0 }")
+  echo "$loss,$delay,$JITTER,$ERR,$CUT,$REORDER,$RATE,$SEED,$opts,$seconds,$goodput,$ratio,$(stat rtt_p50_us),$(stat rtt_p90_us),$(stat rtt_p99_us),$ok" \
+       | tee -a link_bench/results.csv
+  if [ $ok -eq 0 ]; then
+    echo "Le transfert a été corrompu!"
+    cat link_bench/link.log
+    exit 1
+  fi
+done
+done
+done
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Plusieurs senders en parallèle vers un seul receiver en mode serveur (-m),
+# puis un fichier réparti sur autant de flux (-k)
+# Usage: multi_test.sh nombre_de_senders taille_des_fichiers
+
+count=${1:-8}
+size=${2:-100000}
+
+# cleanup d'un test précédent
+rm -rf multi_test
+mkdir multi_test
+
+./receiver -m -o multi_test/received -s multi_test/receiver.csv :: 2457 2> multi_test/receiver.log &
+receiver_pid=$!
+
+cleanup()
+{
+    kill -9 $receiver_pid
+    exit 0
+}
+trap cleanup SIGINT  # Kill les process en arrière plan en cas de ^-C
+
+# Un sender sur deux négocie le format étendu
+sender_pids=""
+for i in $(seq 1 $count); do
+  dd if=/dev/urandom of=multi_test/input_$i bs=1 count=$size &> /dev/null
+  opts=""
+  if [ $((i % 2)) -eq 0 ] ; then
+    opts="-x"
+  fi
+  ./sender $opts ::1 2457 < multi_test/input_$i 2> multi_test/sender_$i.log &
+  sender_pids="$sender_pids $!"
+done
+
+for pid in $sender_pids; do
+  if ! wait $pid ; then
+    echo "Crash d'un sender!"
+    err=1
+  fi
+done
+
+# Le fichier réparti est le seul écrit après les autres
+dd if=/dev/urandom of=multi_test/input_striped bs=1 count=$((size * count)) &> /dev/null
+if ! ./sender -k $count -f multi_test/input_striped ::1 2457 2> multi_test/sender_striped.log ; then
+  echo "Crash du sender réparti!"
+  err=1
+fi
+
+sleep 1
+kill $receiver_pid &> /dev/null
+
+if [[ "$(md5sum < multi_test/input_striped)" != "$(md5sum < $(ls -t multi_test/received.* | head -1))" ]]; then
+  echo "Le transfert réparti a été corrompu!"
+  err=1
+fi
+
+# Chaque fichier envoyé doit se retrouver dans un des fichiers reçus, l'ordre d'arrivée n'est pas connu
+for i in $(seq 1 $count); do
+  sum=$(md5sum < multi_test/input_$i)
+  found=0
+  for f in multi_test/received.*; do
+    if [[ "$(md5sum < $f)" == "$sum" ]]; then
+      found=1
+    fi
+  done
+  if [ $found -eq 0 ]; then
+    echo "Le transfert $i a été corrompu!"
+    err=1
+  fi
+done
+
+if [ -z "$err" ]; then
+  echo "Les $count transferts sont réussis!"
+fi
+exit ${err:-0}
@@ -30,7 +30,7 @@ cleanup()
 trap cleanup SIGINT  # Kill les process en arrière plan en cas de ^-C
 
 # On démarre le transfert
-if ! $valgrind_sender ./sender -s sender.csv ::1 1341 < input_file 2> sender.log ; then
+if ! $valgrind_sender ./sender $SENDER_OPTS -s sender.csv ::1 1341 < input_file 2> sender.log ; then
   echo "Crash du sender!"
   cat sender.log
   err=1  # On enregistre l'erreur
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Compare les boucles epoll et io_uring (-u) sur un transfert local: le sender
+# lit un pipe (qui ne peut pas être mappé) et le receiver écrit sur sa sortie standard.
+# Affiche la durée et les appels système de chaque côté.
+# En format étendu (-x), les datagrammes jumbo arrivent presque un par un: le receiver
+# n'a guère de lots à regrouper, et avec -u il fait à peu près autant d'appels système qu'avec epoll.
+# Usage: uring_bench.sh taille_du_fichier [options du sender]
+
+size=${1:-20000000}
+shift
+opts="$@"
+
+rm -rf uring_bench
+mkdir uring_bench
+head -c $size /dev/urandom > uring_bench/input_file
+
+for mode in "" "-u"; do
+  ./receiver $mode -s uring_bench/receiver.csv :: 2458 > uring_bench/received_file 2> uring_bench/receiver.log &
+  receiver_pid=$!
+  sleep 0.2
+
+  start=$(date +%s%N)
+  if ! cat uring_bench/input_file | ./sender $mode $opts -s uring_bench/sender.csv ::1 2458 2> uring_bench/sender.log ; then
+    echo "Crash du sender!"
+    kill -9 $receiver_pid
+    exit 1
+  fi
+  wait $receiver_pid
+  end=$(date +%s%N)
+
+  if ! cmp -s uring_bench/input_file uring_bench/received_file ; then
+    echo "Le transfert a été corrompu!"
+    exit 1
+  fi
+  echo "${mode:-epoll} $(( (end - start) / 1000000 ))ms" \
+       "sender $(grep syscalls uring_bench/sender.csv)" \
+       "receiver $(grep syscalls uring_bench/receiver.csv)"
+done